@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// malloc with the alignment rounded up to a power of two; the original pointer
+// is stashed in front of the returned block. Release with alignedFree.
+inline void *alignedMalloc(size_t bytes, size_t alignment)
+{
+	char *raw = (char *)malloc(bytes + alignment + sizeof(void *));
+	if (!raw)
+		throw std::bad_alloc();
+	size_t addr = ((size_t)(raw + sizeof(void *)) + alignment - 1) & ~(alignment - 1);
+	((void **)addr)[-1] = raw;
+	return (void *)addr;
+}
+
+inline void alignedFree(void *p)
+{
+	if (p)
+		free(((void **)p)[-1]);
+}
+
+// Frame-lifetime bump allocator.
+// Everything allocated between two reset() calls lives until the second one.
+// Memory is kept across resets, so once the arena has grown to the size of a
+// frame it stops touching the heap.
+class FrameArena
+{
+public:
+	static const size_t ALIGNMENT = 64; // cache line
+
+	FrameArena() : offset_(0), heapAllocations_(0) {}
+	~FrameArena()
+	{
+		for (char *b : blocks_)
+			freeBlock(b);
+	}
+	FrameArena(const FrameArena &) = delete;
+	FrameArena &operator=(const FrameArena &) = delete;
+
+	// start a new frame; blocks that overflowed last frame are merged into one
+	void reset()
+	{
+		if (blocks_.size() > 1)
+		{
+			size_t total = 0;
+			for (size_t i = 0; i < blocks_.size(); ++i)
+			{
+				total += sizes_[i];
+				freeBlock(blocks_[i]);
+			}
+			blocks_.clear();
+			sizes_.clear();
+			newBlock(total);
+		}
+		offset_ = 0;
+	}
+
+	// n default constructed T, aligned to ALIGNMENT; never freed individually
+	template <class T>
+	T *alloc(size_t n)
+	{
+		size_t bytes = (n * sizeof(T) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+		if (blocks_.empty() || offset_ + bytes > sizes_.back())
+		{
+			size_t grow = blocks_.empty() ? 0 : sizes_.back();
+			newBlock(bytes > grow ? bytes : grow);
+		}
+		T *p = (T *)(blocks_.back() + offset_);
+		offset_ += bytes;
+		for (size_t i = 0; i < n; ++i)
+			new (p + i) T;
+		return p;
+	}
+
+	size_t heapAllocations() const { return heapAllocations_; } // total; goldencheck checks it stops growing
+
+private:
+	std::vector<char *> blocks_;
+	std::vector<size_t> sizes_;
+	size_t offset_; // into the last block
+	size_t heapAllocations_;
+
+	void newBlock(size_t bytes)
+	{
+		blocks_.push_back((char *)alignedMalloc(bytes, ALIGNMENT));
+		sizes_.push_back(bytes);
+		offset_ = 0;
+		++heapAllocations_;
+	}
+	static void freeBlock(char *block) { alignedFree(block); }
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include "Renderer.h"
+#include "Surface.h"
+#include "ThreadPool.h"
+#include <Eigen/Core>
+using namespace std;
+using namespace Eigen;
+
+// Two frames in flight: frame N+1's vertex, setup and binning stages run while
+// frame N's tiles are still shaded and presented, so with enough threads a
+// frame costs about its slowest stage instead of the sum of all of them.
+// Frames alternate between two Renderers that share one task pool; each has
+// its own color and depth targets, shader state and varyings, so the raster
+// tasks of one frame never see the setup of the next. Finished frames are
+// copied into fb one frame late.
+class FramePipeline
+{
+public:
+	static const int FRAMES_IN_FLIGHT = 2;
+
+	// same arguments as Renderer; fb only receives finished frames
+	FramePipeline(int w, int h, unsigned int *fb, Camera *camera, Vector3f lightDir, int fbPitch = 0);
+	~FramePipeline();
+	FramePipeline(const FramePipeline &) = delete;
+	FramePipeline &operator=(const FramePipeline &) = delete;
+
+	// the renderer of every other frame; options have to be set on both
+	Renderer &getRenderer(int i) { return *renderers_[i]; }
+	void setThreadCount(int threads, bool pinThreads = false); // see Renderer::setThreadCount
+	int getThreadCount() const { return pool_->size(); }
+
+	// clears the next target, sets up the model and submits its raster tasks,
+	// then waits for the frame before it and presents that one into fb
+	void drawFrame(Model *model, Matrix4f modelMatrix = Matrix4f::Identity());
+	void flush(); // finishes and presents the frame still in flight
+	Renderer::FrameStats getFrameStats() const { return stats_; } // of the frame last presented
+
+private:
+	int width;
+	int height;
+	Surface<unsigned int> screen_; // wraps the caller's memory
+	Surface<unsigned int> targets_[FRAMES_IN_FLIGHT];
+	Renderer *renderers_[FRAMES_IN_FLIGHT];
+	ThreadPool *pool_;
+	int next_; // renderer of the next frame
+	ThreadPool::Task *inFlight_; // finishes the frame of the other renderer, nullptr if none
+	Renderer::FrameStats stats_;
+
+	void present(int i); // waits for inFlight_, then copies target i to the screen
+};
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	bool open(const std::string &filename);
+	void close();
+	inline bool isOpen() const { return data_ != nullptr; }
+	inline const char *data() const { return data_; }
+	inline size_t size() const { return size_; }
+
+private:
+	const char *data_;
+	size_t size_;
+#ifdef _WIN32
+	void *file_;
+	void *mapping_;
+#endif
+};
+
+// modification time of a file in seconds, -1 if it does not exist
+long long fileModifiedTime(const std::string &filename);
+// modification time in nanoseconds, as fine as the file system records it,
+// and size in bytes; false if the file does not exist
+bool fileStamp(const std::string &filename, long long &modified, long long &size);
+// a name next to filename that no other process writes to
+std::string tempFileName(const std::string &filename);
+// moves from over to in one step, so readers see either the old or the new
+// file; mappings of the old file stay valid. Fails on Windows while another
+// process has the old file open
+bool replaceFile(const std::string &from, const std::string &to);
@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+using namespace Eigen;
+
+class ThreadPool;
+
+// Raw Wavefront .obj contents. Faces are triangulated as fans and stored as
+// 3 corners per triangle, each corner holding 0-based vertex/uv/normal indices.
+struct ObjMesh
+{
+	std::vector<Vector3f> verts;
+	std::vector<Vector2f> uvs;
+	std::vector<Vector3f> norms;
+	std::vector<Vector3i> corners;
+
+	void clear();
+};
+
+// Reads the file in one go, splits it into line-aligned chunks and parses the
+// chunks in parallel with a hand-written number scanner, then merges them in
+// file order. The chunks run as tasks on pool, one per pool thread; without a
+// pool the file is parsed as one chunk on the calling thread.
+bool parseObj(const std::string &filename, ObjMesh &mesh, ThreadPool *pool = nullptr);
+
+// The original getline + istringstream parser, kept as the reference for
+// tools/objbench.
+bool parseObjStream(const std::string &filename, ObjMesh &mesh);
@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include "tgaimage.h"
+
+// Platform-neutral render target for running without a window.
+// Pixels are stored contiguously, top row first, as 0x00RRGGBB - the same
+// layout the Win32 DIB section in Window.h uses - so Renderer can draw into
+// data() directly.
+class OffscreenBuffer
+{
+public:
+	OffscreenBuffer(int w, int h);
+	~OffscreenBuffer();
+	OffscreenBuffer(const OffscreenBuffer &) = delete;
+	OffscreenBuffer &operator=(const OffscreenBuffer &) = delete;
+
+	inline int getWidth() const { return width_; }
+	inline int getHeight() const { return height_; }
+	inline unsigned int *data() { return pixels_; }
+
+	void clear();
+	void toImage(TGAImage &img) const; // copy into a 24 bit TGAImage
+	bool writeTGA(const std::string &filename, bool rle = true) const;
+	bool writeRaw(const std::string &filename) const; // headerless 32 bit BGRX dump
+	bool write(const std::string &filename) const; // choose format by extension
+
+private:
+	int width_;
+	int height_;
+	unsigned int *pixels_;
+};
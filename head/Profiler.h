@@ -0,0 +1,105 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Frame profiler: scoped timers per stage and per thread, and counters that
+// are summed per frame. Build with -DPROFILING to enable it; otherwise the
+// PROFILE_* macros expand to nothing and none of this is called.
+// Every thread appends to its own buffers, so recording takes no lock. The
+// counters are atomic and events are tagged with an atomic frame index, so
+// endFrame() may run while pool threads are still recording (as they are with
+// a FramePipeline; a frame then holds the work done between its markers).
+// The event buffers are only read when exporting, after the work is done.
+class Profiler
+{
+public:
+	enum Counter {
+		TRIANGLES_SUBMITTED,
+		TRIANGLES_BACKFACE,  // dropped by backface culling
+		TRIANGLES_OFFSCREEN, // entirely off screen or behind the near plane
+		PIXELS_TESTED,       // pixels evaluated by the span kernels
+		FRAGMENTS_SHADED,    // fragment() invocations
+		COUNTER_COUNT
+	};
+
+	static Profiler &instance();
+	~Profiler();
+
+	void beginFrame();
+	void endFrame(); // collects the counters of every thread into the frame
+
+	long long now() const { return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch_).count(); }
+	// name must outlive the profiler, the scope macros pass string literals
+	inline void record(const char *name, long long start, long long end) {
+		thread().events.push_back(Event{ name, start, end, frame_.load(memory_order_relaxed) }); }
+	inline void count(Counter c, long long n) { thread().counters[c].fetch_add(n, memory_order_relaxed); }
+
+	bool writeChromeTrace(const string &path) const; // for chrome://tracing or Perfetto
+	bool writeFrameCSV(const string &path) const; // one row per frame: stage times in ms, then the counters
+
+private:
+	struct Event
+	{
+		const char *name;
+		long long start, end; // ns since the profiler was created
+		int frame;
+	};
+	struct ThreadData
+	{
+		int id;
+		vector<Event> events;
+		atomic<long long> counters[COUNTER_COUNT];
+	};
+	struct Frame
+	{
+		long long start, end;
+		long long counters[COUNTER_COUNT];
+	};
+
+	Profiler() : epoch_(chrono::steady_clock::now()), frame_(0), frameStart_(0) {}
+	Profiler(const Profiler &) = delete;
+	Profiler &operator=(const Profiler &) = delete;
+
+	inline ThreadData &thread() {
+		thread_local ThreadData *data = registerThread();
+		return *data; }
+	ThreadData *registerThread();
+	vector<const char *> stageNames() const; // in order of first use
+
+	chrono::steady_clock::time_point epoch_;
+	mutable mutex mutex_; // guards threads_
+	vector<ThreadData *> threads_;
+	vector<Frame> frames_;
+	atomic<int> frame_; // index of the frame being recorded, frames_.size()
+	long long frameStart_;
+};
+
+// times the enclosing block
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char *name) : name_(name), start_(Profiler::instance().now()) {}
+	~ProfileScope() { Profiler::instance().record(name_, start_, Profiler::instance().now()); }
+
+private:
+	const char *name_;
+	long long start_;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifdef PROFILING
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_COUNT(counter, n) Profiler::instance().count(Profiler::counter, (n))
+#define PROFILE_BEGIN_FRAME() Profiler::instance().beginFrame()
+#define PROFILE_END_FRAME() Profiler::instance().endFrame()
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(counter, n)
+#define PROFILE_BEGIN_FRAME()
+#define PROFILE_END_FRAME()
+#endif
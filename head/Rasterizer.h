@@ -0,0 +1,154 @@
+#pragma once
+#include <algorithm>
+#include <Eigen/Core>
+#include "Surface.h"
+using namespace Eigen;
+
+// Triangle setup for incremental rasterization.
+// The barycentric weights and the depth are affine in the pixel position, so
+// their plane equations are solved once per triangle and then stepped with adds
+// instead of solving barycentric() for every pixel of the bounding box.
+// u is the weight of v2 and v the weight of v1, the same convention as
+// Renderer::barycentric, so a pixel is covered when u >= 0, v >= 0, u + v <= 1.
+struct TriangleSetup
+{
+	int minX, maxX, minY, maxY; // bounding box, clamped to the clip rectangle
+	float u0, dudx, dudy; // plane values at (minX, minY) and their steps
+	float v0, dvdx, dvdy;
+	float z0, dzdx, dzdy;
+
+	// returns false for degenerate triangles and empty bounding boxes
+	bool setup(const Vector3f s[3], int clipMinX, int clipMinY, int clipMaxX, int clipMaxY)
+	{
+		maxX = std::min((int)std::max(std::max(s[0].x(), s[1].x()), s[2].x()), clipMaxX);
+		minX = std::max((int)std::min(std::min(s[0].x(), s[1].x()), s[2].x()), clipMinX);
+		maxY = std::min((int)std::max(std::max(s[0].y(), s[1].y()), s[2].y()), clipMaxY);
+		minY = std::max((int)std::min(std::min(s[0].y(), s[1].y()), s[2].y()), clipMinY);
+		if (minX > maxX || minY > maxY)
+			return false;
+
+		double abx = s[1].x() - s[0].x(), aby = s[1].y() - s[0].y();
+		double acx = s[2].x() - s[0].x(), acy = s[2].y() - s[0].y();
+		double area = abx * acy - aby * acx;
+		if (area == 0)
+			return false;
+		double inv = 1.0 / area;
+		double px = minX - s[0].x(), py = minY - s[0].y();
+
+		// v = cross(AP, AC) / area, u = cross(AB, AP) / area
+		double dvx = acy * inv, dvy = -acx * inv;
+		double dux = -aby * inv, duy = abx * inv;
+		double dz1 = s[1].z() - s[0].z(), dz2 = s[2].z() - s[0].z();
+
+		dvdx = (float)dvx; dvdy = (float)dvy;
+		dudx = (float)dux; dudy = (float)duy;
+		dzdx = (float)(dvx * dz1 + dux * dz2);
+		dzdy = (float)(dvy * dz1 + duy * dz2);
+		double v = px * dvx + py * dvy, u = px * dux + py * duy;
+		v0 = (float)v;
+		u0 = (float)u;
+		z0 = (float)(s[0].z() + v * dz1 + u * dz2);
+		return true;
+	}
+
+	// plane values at pixel (x, y)
+	inline void planeAt(int x, int y, float &u, float &v, float &z) const
+	{
+		float dx = (float)(x - minX), dy = (float)(y - minY);
+		u = u0 + dx * dudx + dy * dudy;
+		v = v0 + dx * dvdx + dy * dvdy;
+		z = z0 + dx * dzdx + dy * dzdy;
+	}
+
+	// Upper bound of the stored depth (z squared, larger is nearer) over the
+	// pixel rectangle x0..x1, y0..y1. z is affine, so z squared peaks at a
+	// corner; the bound is widened slightly to cover the span kernels' rounding.
+	inline float nearestDepth(int x0, int y0, int x1, int y1) const
+	{
+		float u, v, z[4];
+		planeAt(x0, y0, u, v, z[0]);
+		planeAt(x1, y0, u, v, z[1]);
+		planeAt(x0, y1, u, v, z[2]);
+		planeAt(x1, y1, u, v, z[3]);
+		float hi = std::max(std::max(z[0] * z[0], z[1] * z[1]), std::max(z[2] * z[2], z[3] * z[3]));
+		return hi + 1e-5f * hi;
+	}
+};
+
+// 16 bit unorm depth for the shadow map. It holds the same squared depth the
+// color pass keeps in its float zBuffer, mapped from [0, DEPTH16_RANGE]; 0 is
+// the cleared value. The screen z of our projections lands slightly above 1,
+// and one step (~6e-5) is well below the smallest shadow bias of 0.001.
+typedef unsigned short DepthUnorm16;
+const float DEPTH16_RANGE = 4.0f;
+
+inline DepthUnorm16 encodeDepth16(float zz)
+{
+	zz = zz < 0 ? 0 : (zz > DEPTH16_RANGE ? DEPTH16_RANGE : zz);
+	return (DepthUnorm16)(zz * (65535.0f / DEPTH16_RANGE) + 0.5f);
+}
+
+inline float decodeDepth16(DepthUnorm16 d)
+{
+	return d * (DEPTH16_RANGE / 65535.0f);
+}
+
+// Depth-only rasterization of one triangle into a 16 bit depth buffer, limited
+// to the rectangle minX..maxX, minY..maxY. Rows are addressed like the color
+// pass, depthBuffer[height - y]. The loop is branch free so it auto-vectorizes.
+inline void rasterizeDepth16(const TriangleSetup &tri, Surface<DepthUnorm16> &depthBuffer, int height,
+	int minX, int minY, int maxX, int maxY)
+{
+	minX = std::max(minX, tri.minX);
+	maxX = std::min(maxX, tri.maxX);
+	minY = std::max(minY, tri.minY);
+	maxY = std::min(maxY, tri.maxY);
+	for (int y = minY; y <= maxY; ++y)
+	{
+		float u0, v0, z0;
+		tri.planeAt(minX, y, u0, v0, z0);
+		DepthUnorm16 *row = depthBuffer[height - y];
+		for (int x = minX; x <= maxX; ++x)
+		{
+			float k = (float)(x - minX);
+			float u = u0 + k * tri.dudx, v = v0 + k * tri.dvdx, z = z0 + k * tri.dzdx;
+			DepthUnorm16 d = encodeDepth16(z * z);
+			bool pass = u >= 0 && v >= 0 && u + v <= 1 && d > row[x];
+			row[x] = pass ? d : row[x];
+		}
+	}
+}
+
+// A covered pixel that passed the depth test, handed to the fragment stage.
+// z is the value to store in the depth buffer (already squared).
+struct SpanFragment
+{
+	int x;
+	float u, v, z;
+};
+
+// Longest span a kernel processes per call; callers split wider rows.
+const int SPAN_MAX = 64;
+
+// Coverage and depth kernel: evaluates the triangle's planes for pixels
+// x0..x1 (at most SPAN_MAX) of row y, tests them against depthRow and writes
+// the survivors to out. Returns the number of survivors.
+typedef int (*SpanKernel)(const TriangleSetup &tri, int y, int x0, int x1, const float *depthRow, SpanFragment *out);
+
+enum class RasterISA {
+	SCALAR, // portable fallback
+	SSE2,   // 4 pixels per step
+	AVX2    // 8 pixels per step
+};
+
+// Depth comparison of a span kernel. EQUAL is for shading after a depth
+// pre-pass: it only passes pixels whose depth the same kernel stored, so the
+// pre-pass and the shading pass must split rows into the same spans.
+enum class DepthTest {
+	GREATER,
+	EQUAL
+};
+
+RasterISA bestRasterISA(); // widest kernel the CPU supports, detected once via CPUID
+bool isRasterISASupported(RasterISA isa);
+SpanKernel getSpanKernel(RasterISA isa, DepthTest test = DepthTest::GREATER);
@@ -3,6 +3,10 @@
 #include "Color.h"
 #include "Camera.h"
 #include "Shader.h"
+#include "Rasterizer.h"
+#include "Surface.h"
+#include "ThreadPool.h"
+#include <atomic>
 #include <Eigen/Core>
 using namespace std;
 using namespace Eigen;
@@ -17,35 +21,104 @@ public:
 	};
 
 	Renderer() = default;
-	Renderer(int w, int h, unsigned int** fb, Camera *camera, Vector3f lightDir);
+	// fb is the contiguous 0x00RRGGBB target, top row first; fbPitch in pixels, 0 means w
+	Renderer(int w, int h, unsigned int *fb, Camera *camera, Vector3f lightDir, int fbPitch = 0);
 	~Renderer();
-	void bufferClear(); // clear frame buffer and z buffer
+	// clear frame buffer and z buffer, the shadow map is kept. Tiles are only
+	// flagged here and cleared when first drawn to, at the end of drawModel, or
+	// by getFrameBuffer()/getZBuffer(); until then the memory passed to the
+	// constructor still holds the previous frame
+	void bufferClear();
 	
 	// set pixel with color c, ½Ϊԭ
 	void set(const int &x, const int &y, const Color &c) { 
+		prepareDirectWrite();
 		frameBuffer_[height - y][x] = c.hex; }
 	void setZBuffer(const int &x, const int &y, const float &z) {
-		zBuffer[height - y][x] = z; }
+		prepareDirectWrite();
+		zBuffer[height - y][x] = z;
+		invalidateHiZ(x, height - y, z); }
+	// both finish the pending clears, the caller may read or write any pixel
+	Surface<unsigned int> &getFrameBuffer() {
+		prepareDirectWrite();
+		return frameBuffer_; }
+	Surface<float> &getZBuffer() {
+		prepareDirectWrite();
+		return zBuffer; }
 	void setCamera(Camera *camera) { camera_ = camera; }
+	void setLightDir(Vector3f lightDir);
+	// the shadow map is re-rendered only when the model, the model matrix or the
+	// light changes; call this when the model's vertices were modified in place
+	void invalidateShadowMap() { shadowValid_ = false; }
+	void setRasterISA(RasterISA isa); // falls back to the best supported kernel
+	RasterISA getRasterISA() const { return rasterISA_; }
+	const FrameArena &getArena() const { return arena_; }
+	// hierarchical z rejection and front-to-back binning in drawModel, on by default
+	void setOcclusionCulling(bool enable) { occlusionCulling_ = enable; }
+	bool getOcclusionCulling() const { return occlusionCulling_; }
+	// drawModel rasterizes depth only first and then shades the pixels whose
+	// depth matches, so fragment() runs once per visible pixel; off by default
+	void setDepthPrepass(bool enable) { depthPrepass_ = enable; }
+	bool getDepthPrepass() const { return depthPrepass_; }
+	// drawModel writes a G-buffer and shades it in a separate full screen pass,
+	// so shading cost no longer depends on overdraw; takes precedence over the
+	// depth pre-pass. The G-buffer is only allocated while enabled
+	void setDeferredShading(bool enable);
+	bool getDeferredShading() const { return gFace != nullptr; }
+	// counters of the frame, reset by bufferClear()
+	struct FrameStats {
+		long long prepassFragments; // pixels that passed the depth test in the pre-pass or the G-buffer pass
+		long long fragmentsShaded; // fragment() invocations
+	};
+	FrameStats getFrameStats() const { return FrameStats{ prepassFragments_, fragmentsShaded_ }; }
+	// size of the renderer's task pool, counting the thread that calls
+	// drawModel; 0 uses one thread per hardware thread, the default.
+	// pinThreads binds every worker thread to its own core, see ThreadPool;
+	// the calling thread keeps its affinity
+	void setThreadCount(int threads, bool pinThreads = false);
+	int getThreadCount() const { return pool_->size(); }
+	// runs the tasks on a pool owned by the caller, which has to outlive the
+	// renderer; renderers sharing a pool must be driven from the same thread
+	void setThreadPool(ThreadPool *pool);
+	ThreadPool &getThreadPool() { return *pool_; }
+	// grayscale copy of the shadow map, only allocated and filled while enabled
+	void setShadowDebugView(bool enable);
+	Surface<unsigned int> *getShadowDebugView() { return depthMap; }
 	void drawLine(int x0, int y0, int x1, int y1, const Color& c);
 	void drawLine(Vector2i t0, Vector2i t1, const Color& c);
 	void drawTriangle(Vector2i t0, Vector2i t1, Vector2i t2, const Color &c);
 	void drawTriangle(Vector3f t0, Vector3f t1, Vector3f t2, const Color &c);
-	void drawTriangle(Vector3f screenCoords[3], FShader *shader, int iface, unsigned int **frameBuff, float **zBuffer);
+	void drawTriangle(Vector3f screenCoords[3], FShader *shader, int iface, Surface<unsigned int> &frameBuff, Surface<float> &zBuffer);
+	void drawTriangle(const TriangleSetup &tri, FShader *shader, int iface, Surface<unsigned int> &frameBuff, Surface<float> &zBuffer,
+		int minX, int minY, int maxX, int maxY); // only touches pixels inside the given rectangle
 	void drawModel(Model *model, DrawMode mode, Matrix4f modelMatrix = Matrix4f::Identity()); // draw obj model
+	// drawModel without the final wait: returns once the geometry is set up and
+	// the raster tasks are submitted. The returned task finishes the frame; the
+	// targets, the options and the model must be left alone until it has
+	ThreadPool::Task *submitModel(Model *model, DrawMode mode, Matrix4f modelMatrix = Matrix4f::Identity());
+	std::pair<float, float> barycentric(const Vector3f &v0, const Vector3f &v1, const Vector3f &v2, const Vector2i &p); // p
 
 private:
 	int width;
 	int height;
-	unsigned int** frameBuffer_;
-	float** zBuffer;
+	Surface<unsigned int> frameBuffer_; // wraps the caller's memory
+	Surface<float> zBuffer;
 	Vector3f lightPos_;
 	Vector3f lightDir_;
 	Model *model;
 	Camera *camera_;
 	Matrix4f projectionMatrix_;
 	Matrix4f viewPortMatrix_;
-	omp_lock_t mylock;
+	RasterISA rasterISA_;
+	SpanKernel spanKernel_; // coverage and depth test, selected at runtime
+	SpanKernel spanKernelEqual_; // equal depth test for the shading pass after the pre-pass
+	bool depthPrepass_;
+	atomic<long long> prepassFragments_; // FrameStats, added to by the raster tasks
+	atomic<long long> fragmentsShaded_;
+	ThreadPool *pool_; // every parallel stage of drawModel runs as tasks here
+	vector<ThreadPool::Task *> shadowDone_, frameDone_, tileTasks_; // reused each frame
+	bool ownsPool_;
+	FrameArena arena_; // per draw shader varyings, reused across frames
 
 	float FOV_;
 	float zNear_;
@@ -54,8 +127,101 @@ private:
 	Shader *shader;
 	// Shadow
 	DepthShader *depthShader;
-	unsigned int **depthMap;
-	float **shadowBuffer;
+	Surface<unsigned int> *depthMap; // debug view, nullptr unless enabled
+	Surface<DepthUnorm16> shadowBuffer;
+	bool shadowValid_;
+	Model *shadowModel_; // what the cached shadow map was rendered from
+	Matrix4f shadowT_;
+
+	// sort-middle rasterization: triangles are set up and binned into TILE_SIZE
+	// square screen tiles, then every tile is rasterized by exactly one thread
+	static const int TILE_SIZE = 64;
+	int tilesX;
+	int tilesY;
+	vector<TriangleSetup> triangles; // per face setup of the color pass
+	vector<char> triVisible;
+	vector<vector<int>> tileBins; // face indices per tile, in submission order
+	// the shadow pass has its own, so its raster tasks can still run while the
+	// color pass is set up
+	vector<TriangleSetup> shadowTriangles;
+	vector<char> shadowVisible;
+	vector<vector<int>> shadowBins;
+	vector<char> tileNeedsClear; // bufferClear() was called since the tile was last drawn to
+	vector<char> tileDirty; // holds pixels drawn since its last clear
+	bool directWrite_; // pending clears were flushed for writes outside the tile pipeline
+
+	// clip stage: triangles are clipped exactly against the near plane, and
+	// against the window edges only where a vertex leaves the guard band; inside
+	// the band the bounding box clamp of the setup is all the clipping needed
+	enum class ClipResult {
+		INSIDE,  // no clipping needed
+		OUTSIDE, // all vertices outside one plane
+		CLIP
+	};
+	static const int GUARD_BAND = 2048; // pixels beyond each window edge
+	static const int MAX_CLIP_VERTS = 8; // a triangle clipped by the near and the four guard band planes
+	vector<char> needsClip; // per face, set by the geometry stage
+	ClipResult classifyTriangle(const Vector4f h[3]) const;
+	void clipTriangles(int nfaces); // appends the pieces of the faces that need clipping
+
+	// Hierarchical z: a lower bound of the depth buffer per HIZ_BLOCK square
+	// block and per tile. A triangle whose nearest depth over a block or a
+	// tile is not above the bound fails the depth test on all its pixels there
+	// and is skipped. Block bounds are recomputed from the depth buffer when a
+	// block that was written to is tested again; tile bounds are the minimum
+	// of their blocks. Stale bounds are lower than the real minimum, so they
+	// only reject less, never wrongly.
+	static const int HIZ_BLOCK = 8;
+	bool occlusionCulling_;
+	Surface<float> hiZ; // per block, rows like the depth buffer
+	Surface<unsigned char> hiZStale; // written since the bound was computed
+	vector<float> tileMinZ;
+	vector<int> binOrder; // visible triangles in binning order
+	vector<float> binKey;
+	inline void invalidateHiZ(int x, int row, float z) {
+		hiZStale[row / HIZ_BLOCK][x / HIZ_BLOCK] = 1;
+		float &t = tileMinZ[(row / TILE_SIZE) * tilesX + x / TILE_SIZE];
+		t = std::min(t, z); }
+	float blockMinZ(int br, int bc); // recomputes a block bound from the depth buffer
+	void updateTileMinZ(int t);
+
+	// Deferred shading: the geometry pass keeps the nearest face and its
+	// barycentrics per pixel next to the depth buffer; the varyings of the draw
+	// are still in the arena, so fragment() can run on them afterwards, once
+	// per covered pixel. The depth is the zBuffer itself.
+	Surface<int> *gFace; // -1 where nothing was drawn since the last resolve; nullptr unless enabled
+	Surface<Vector2f> *gBary; // u, v of gFace at the pixel
+	ThreadPool::Task *rasterizeGBufferTiles();
+	int rasterizeGBuffer(const TriangleSetup &tri, int iface, int minX, int minY, int maxX, int maxY);
+	ThreadPool::Task *resolveGBuffer(const vector<ThreadPool::Task *> &deps); // shades and resets every written pixel
+
+	void binTriangles(const vector<TriangleSetup> &tris, const vector<char> &visible, vector<vector<int>> &bins, bool frontToBack = false);
+	void tileRect(int t, int &minX, int &minY, int &maxX, int &maxY);
+	void clearTile(int t);
+	void flushClears(); // clear every tile that is still pending
+	ThreadPool::Task *clearUnusedTiles(); // as tasks, for the pending tiles without triangles
+	inline void prepareDirectWrite() {
+		if (!directWrite_) flushForDirectWrite(); }
+	void flushForDirectWrite();
+	// both return the task that finishes the shadow map
+	ThreadPool::Task *renderShadowMap(const Matrix4f &modelMatrix, const Matrix4f &lightProjection, const Matrix4f &lightView);
+	ThreadPool::Task *rasterizeShadowTiles(); // depth only, no fragment stage; clears the map too
+	void fillShadowDebugView();
+	// the raster loops are instantiated per shader type; with a final shader
+	// class the fragment() call is resolved statically and inlined into the span loop
+	// the stages below submit their tasks after deps and return the task that finishes them
+	template <class ShaderT>
+	ThreadPool::Task *rasterizeTiles(ShaderT *shader, const vector<ThreadPool::Task *> &deps);
+	// rasterizeTriangle with per block hierarchical z rejection, against the
+	// member depth buffer; refreshed is set if a block bound was recomputed
+	template <class ShaderT>
+	int rasterizeTriangleHiZ(const TriangleSetup &tri, ShaderT *shader, int iface, Surface<unsigned int> &frameBuff, Surface<float> &zBuffer,
+		int minX, int minY, int maxX, int maxY, bool &refreshed);
+	// both return the number of fragments that passed the depth test
+	template <class ShaderT>
+	int rasterizeTriangle(const TriangleSetup &tri, ShaderT *shader, int iface, Surface<unsigned int> &frameBuff, Surface<float> &zBuffer,
+		int minX, int minY, int maxX, int maxY, SpanKernel kernel);
+	int rasterizeDepth(const TriangleSetup &tri, Surface<float> &zBuffer, int minX, int minY, int maxX, int maxY); // pre-pass
 
 	inline bool isLegal(const int& x, const int& y) {
 		if (x < 0 || x >= width || y < 0 || y >= height) return false;
@@ -64,7 +230,6 @@ private:
 
 	int isLeft(Vector2i l0, Vector2i l1, Vector2i p);
 	bool isInTriangle(const Vector2i& v0, const Vector2i& v1, const Vector2i& v2, const Vector2i& p); // жϵpǷ
-	std::pair<float, float> barycentric(const Vector3f &v0, const Vector3f &v1, const Vector3f &v2, const Vector2i &p); // p
 	Vector3f transform(const Vector3f &p, const Matrix4f &transformMatrix); // 3dp4x4任
 	void initProjectionMatrix();
 	Matrix4f computeProjectionMatrix(float width, float height, float FOV, float zNear, float zFar);
@@ -1,10 +1,15 @@
 #pragma once
 #include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
 #include <map>
 #include <vector>
 #include <string>
 #include "Color.h"
 #include "model.h"
+#include "Arena.h"
+#include "Rasterizer.h"
+#include "ThreadPool.h"
 using namespace Eigen;
 using namespace std;
 
@@ -15,7 +20,37 @@ public:
 	virtual Vector3f vertex(int iface, int nthvert) = 0;
 	virtual Color fragment(int iface, std::pair<float, float> barycentricUV) = 0;
 
+	// viewport space position of model vertex i before the perspective divide,
+	// w is the view depth; valid after transformVertices()
+	const Vector4f &clipCoord(int i) const { return transformedH[i]; }
+
 protected:
+	// post-transform vertex cache: every unique model vertex is transformed
+	// once per pass and vertex() gathers from it by index
+	vector<Vector3f> transformed;
+	vector<Vector4f, aligned_allocator<Vector4f>> transformedH; // before the divide, for clipping
+
+	void transformVertices(const Model *model, const Matrix4f &M, ThreadPool &pool)
+	{
+		const int BATCH = 256;
+		int n = model->nverts();
+		transformed.resize(n);
+		transformedH.resize(n);
+		const Vector3f *in = model->vertData();
+		Vector3f *out = transformed.data();
+		Vector4f *outH = transformedH.data();
+		// one task per batch
+		pool.wait(pool.parallelFor(0, (n + BATCH - 1) / BATCH, 1, [=](int batch) {
+			int b = batch * BATCH, count = std::min(BATCH, n - b);
+			Map<const Matrix<float, 3, Dynamic>> p(in[b].data(), 3, count);
+			Map<Matrix<float, 4, Dynamic>> h(outH[b].data(), 4, count);
+			h = M.leftCols<3>() * p;
+			h.colwise() += M.col(3);
+			Map<Matrix<float, 3, Dynamic>> q(out[b].data(), 3, count);
+			q = h.topRows<3>().array().rowwise() / h.row(3).array();
+		}));
+	}
+
 	Vector3f transform(const Vector3f &p, const Matrix4f &transformMatrix){
 		Vector4f p_h(p.x(), p.y(), p.z(), 1);
 		Vector4f p_after = transformMatrix * p_h;
@@ -35,10 +70,11 @@ protected:
 // ʹ˷ռ䷨ͼ
 // ʹ˸߹ͼ
 // ʹӰӳ
-class Shader : public FShader
+class Shader final : public FShader
 {
 public:
 	Matrix4f T; // viewport matrix * projection matrix * view matrix * model matrix
+	Matrix4f modelMatrix;
 	Matrix4f normalMatrix; // model matrix inverse transpose
 	Matrix4f viewPortMatrix;
 	Matrix4f matrixShadow; // transform framebuffer screen coordinates to shadowbuffer screen coordinates
@@ -47,20 +83,28 @@ public:
 	//Vector3f screenCoords[3];
 	//Vector3f normal[3];
 	//Matrix3f TBN;
-	vector < vector<Vector2i>> uv;
-	vector < vector<Vector3f>> worldCoords;
-	vector < vector<Vector3f>> screenCoords;
-	vector < vector<Vector3f>> normal;
-	vector<Matrix3f> TBN;
+	// per face corner varyings, [3 * iface + nthvert], allocated from the frame arena
+	Vector2i *uv;
+	Vector3f *worldCoords;
+	Vector3f *screenCoords;
+	// homogeneous shadow map coordinates, divided per pixel: both projections are
+	// perspective, so only the undivided coordinates interpolate exactly
+	Vector4f *shadowCoords;
+	Vector3f *normal;
+	Vector4f *tangent; // view independent, xyz after normalMatrix, w is the bitangent sign
+	Vector4f *uvTangents; // per uv index, filled by transformVertices()
+	int *lod; // per face mip level, set by computeLOD()
+	int faceCapacity; // faces the varyings have room for, model faces plus clipped triangles
 	Model *model;
 	Vector3f lightDir;
-	float **shadowBuffer;
+	const Surface<DepthUnorm16> *shadowBuffer;
 	int height;
 	int width;
 	Vector3f cameraPos;
 
-	Shader(Matrix4f viewPort, Vector3f lightD, float **shadow, int h, int w) :
+	Shader(Matrix4f viewPort, Vector3f lightD, const Surface<DepthUnorm16> *shadow, int h, int w) :
 		viewPortMatrix(viewPort), 
+		uv(nullptr), worldCoords(nullptr), screenCoords(nullptr), shadowCoords(nullptr), normal(nullptr), tangent(nullptr), uvTangents(nullptr), lod(nullptr), faceCapacity(0),
 		model(nullptr), 
 		lightDir(lightD),
 		shadowBuffer(shadow),
@@ -70,126 +114,191 @@ public:
 
 	virtual Vector3f vertex(int iface, int nthvert)
 	{
-		worldCoords[iface][nthvert] = model->vert(iface, nthvert);
-		uv[iface][nthvert] = model->uv(iface, nthvert);
-		normal[iface][nthvert] = model->normal(iface, nthvert);
-		screenCoords[iface][nthvert] = transform(worldCoords[iface][nthvert], T);
-		return screenCoords[iface][nthvert];
+		int c = 3 * iface + nthvert;
+		Vector3f p = model->vert(iface, nthvert);
+		worldCoords[c] = modelMatrix.topLeftCorner<3, 3>() * p + modelMatrix.topRightCorner<3, 1>();
+		uv[c] = model->uv(iface, nthvert);
+		normal[c] = model->normal(iface, nthvert);
+		tangent[c] = uvTangents[model->uvIndex(iface, nthvert)];
+		screenCoords[c] = transformed[model->vertIndex(iface, nthvert)];
+		shadowCoords[c] = matrixShadow * Vector4f(screenCoords[c].x(), screenCoords[c].y(), screenCoords[c].z(), 1.0f);
+		return screenCoords[c];
+	}
+
+	// batch transform of all model vertices and tangents, call before vertex()
+	void transformVertices(ThreadPool &pool)
+	{
+		FShader::transformVertices(model, T, pool);
+		const Vector4f *src = model->tangentData();
+		Matrix3f m = normalMatrix.topLeftCorner<3, 3>();
+		Vector4f *dst = uvTangents;
+		pool.wait(pool.parallelFor(0, model->nuvs(), 1024, [=](int i) {
+			Vector3f t = (m * src[i].head<3>()).normalized();
+			dst[i] = Vector4f(t.x(), t.y(), t.z(), src[i].w());
+		}));
 	}
 
 	virtual Color fragment(int iface, std::pair<float, float> barycentricUV)
 	{
 		// 㵱ǰضӦĸӦУ
 		float u = barycentricUV.first, v = barycentricUV.second;
-		Vector2i uvAB = uv[iface][1] - uv[iface][0],
-			uvAC = uv[iface][2] - uv[iface][0];
-		Vector2f uvP = uv[iface][0].cast<float>() + v * uvAB.cast<float>() + u * uvAC.cast<float>();
+		Vector2i uvAB = uv[3 * iface + 1] - uv[3 * iface + 0],
+			uvAC = uv[3 * iface + 2] - uv[3 * iface + 0];
+		Vector2f uvP = uv[3 * iface + 0].cast<float>() + v * uvAB.cast<float>() + u * uvAC.cast<float>();
 
-		Vector3f AB = screenCoords[iface][1] - screenCoords[iface][0],
-			AC = screenCoords[iface][2] - screenCoords[iface][0];
-		Vector3f p3f = screenCoords[iface][0] + v * AB + u * AC;
-		Vector3f shadowP = transform(p3f, matrixShadow);
+		Vector4f SAB = shadowCoords[3 * iface + 1] - shadowCoords[3 * iface + 0],
+			SAC = shadowCoords[3 * iface + 2] - shadowCoords[3 * iface + 0];
+		Vector4f shadowH = shadowCoords[3 * iface + 0] + v * SAB + u * SAC;
+		Vector3f shadowP = shadowH.head<3>() / shadowH.w();
 
-		Vector3f WAB = worldCoords[iface][1] - worldCoords[iface][0],
-			WAC = worldCoords[iface][2] - worldCoords[iface][0];
-		Vector3f worldPos = worldCoords[iface][0] + v * WAB + u * WAC;
+		Vector3f WAB = worldCoords[3 * iface + 1] - worldCoords[3 * iface + 0],
+			WAC = worldCoords[3 * iface + 2] - worldCoords[3 * iface + 0];
+		Vector3f worldPos = worldCoords[3 * iface + 0] + v * WAB + u * WAC;
 
 		// 㷨
-		Vector3f NAB = normal[iface][1] - normal[iface][0],
-			NAC = normal[iface][2] - normal[iface][0];
-		Vector3f triN = normal[iface][0] + v * NAB + u * NAC;
+		Vector3f NAB = normal[3 * iface + 1] - normal[3 * iface + 0],
+			NAC = normal[3 * iface + 2] - normal[3 * iface + 0];
+		Vector3f triN = normal[3 * iface + 0] + v * NAB + u * NAC;
 		triN.normalize();
 		Vector3f N = transform(triN, normalMatrix);
 		N.normalize();
-		TBN[iface].row(2) = N;
-		Vector3f n = model->normal(Vector2i(uvP.x(), uvP.y())); // ͼ
-		Vector3f light = TBN[iface] * lightDir; // ߷תռ
+		// tangent frame from the interpolated vertex tangents, re-orthogonalized against N
+		Vector4f TAB = tangent[3 * iface + 1] - tangent[3 * iface + 0],
+			TAC = tangent[3 * iface + 2] - tangent[3 * iface + 0];
+		Vector4f triT = tangent[3 * iface + 0] + v * TAB + u * TAC;
+		Vector3f Tn = triT.head<3>() - N * N.dot(triT.head<3>());
+		Tn.normalize();
+		Matrix3f tbn;
+		tbn.row(0) = Tn;
+		tbn.row(1) = N.cross(Tn) * (tangent[3 * iface + 0].w() < 0 ? -1.0f : 1.0f);
+		tbn.row(2) = N;
+		Vector3f n = model->normal(Vector2i(uvP.x(), uvP.y()), lod[iface]); // ͼ
+		Vector3f light = tbn * lightDir; // ߷תռ
 		light.normalize();
 
 		// compute color
 		// phong
-		Color objectColor = model->diffuse(Vector2i(uvP.x(), uvP.y()));
+		Color objectColor = model->diffuse(Vector2i(uvP.x(), uvP.y()), lod[iface]);
 		float ambient = 0.3;
 		float diff = std::max(n.dot(light), 0.0f);
 		Vector3f viewDir = cameraPos - worldPos;
 		viewDir.normalize();
 		Vector3f reflectDir = reflect(-light, n);
 		float spec = pow(max(viewDir.dot(reflectDir), 0.0f), 32);
-		float specular = model->specular(Vector2i(uvP.x(), uvP.y())) * spec * 0.01;
+		float specular = model->specular(Vector2i(uvP.x(), uvP.y()), lod[iface]) * spec * 0.01;
 
-		float shadowDepth = shadowBuffer[height - (int)shadowP.y()][(int)shadowP.x()];
+		// points outside the light's view read the nearest edge of the shadow map
+		int shadowRow = std::min(std::max(height - (int)shadowP.y(), 0), shadowBuffer->getHeight() - 1);
+		int shadowCol = std::min(std::max((int)shadowP.x(), 0), shadowBuffer->getWidth() - 1);
+		float shadowDepth = decodeDepth16((*shadowBuffer)[shadowRow][shadowCol]);
 		float shadow = shadowDepth > shadowP.z()*shadowP.z() + std::max(0.001f, 0.02f*(1.0f-n.dot(light))) ? 1.0 : 0.0;
 		
 		Color color = objectColor * (ambient + (1.0 - shadow) * (diff + specular));
 		return color;
 	}
 
-	void setModel(Model *m) { 
+	void setModel(Model *m, FrameArena &arena) { 
 		model = m; 
-		uv.resize(m->nfaces());
-		worldCoords.resize(m->nfaces());
-		screenCoords.resize(m->nfaces());
-		normal.resize(m->nfaces());
-		TBN.resize(m->nfaces());
-		for (int i = 0; i < m->nfaces(); ++i)
-		{
-			uv[i].resize(3);
-			worldCoords[i].resize(3);
-			screenCoords[i].resize(3);
-			normal[i].resize(3);
-		}
+		int corners = 3 * m->nfaces();
+		uv = arena.alloc<Vector2i>(corners);
+		worldCoords = arena.alloc<Vector3f>(corners);
+		screenCoords = arena.alloc<Vector3f>(corners);
+		shadowCoords = arena.alloc<Vector4f>(corners);
+		normal = arena.alloc<Vector3f>(corners);
+		tangent = arena.alloc<Vector4f>(corners);
+		uvTangents = arena.alloc<Vector4f>(m->nuvs());
+		lod = arena.alloc<int>(m->nfaces());
+		faceCapacity = m->nfaces();
+	}
+	// Triangles produced by clipping are appended as extra faces after the
+	// model's own. Grows the varyings to total faces, keeping what was written.
+	void reserveFaces(int total, FrameArena &arena)
+	{
+		if (total <= faceCapacity)
+			return;
+		int corners = 3 * faceCapacity;
+		regrow(uv, corners, 3 * total, arena);
+		regrow(worldCoords, corners, 3 * total, arena);
+		regrow(screenCoords, corners, 3 * total, arena);
+		regrow(shadowCoords, corners, 3 * total, arena);
+		regrow(normal, corners, 3 * total, arena);
+		regrow(tangent, corners, 3 * total, arena);
+		regrow(lod, faceCapacity, total, arena);
+		faceCapacity = total;
+	}
+	// Writes corner nthvert of the clipped face iface. bary are the weights of
+	// srcFace's corners at the new vertex, taken in clip space so they are the
+	// object space weights; screen is the new vertex after the divide.
+	void clipCorner(int iface, int nthvert, int srcFace, const Vector3f &bary, const Vector3f &screen)
+	{
+		int c = 3 * iface + nthvert, s = 3 * srcFace;
+		Vector2f uvf = bary[0] * uv[s].cast<float>() + bary[1] * uv[s + 1].cast<float>() + bary[2] * uv[s + 2].cast<float>();
+		uv[c] = Vector2i((int)std::lround(uvf.x()), (int)std::lround(uvf.y()));
+		worldCoords[c] = bary[0] * worldCoords[s] + bary[1] * worldCoords[s + 1] + bary[2] * worldCoords[s + 2];
+		normal[c] = bary[0] * normal[s] + bary[1] * normal[s + 1] + bary[2] * normal[s + 2];
+		tangent[c] = bary[0] * tangent[s] + bary[1] * tangent[s + 1] + bary[2] * tangent[s + 2];
+		tangent[c].w() = tangent[s].w();
+		screenCoords[c] = screen;
+		shadowCoords[c] = matrixShadow * Vector4f(screen.x(), screen.y(), screen.z(), 1.0f);
+	}
+	// Mip level from the screen space uv derivatives. Texture coordinates are
+	// interpolated affinely in screen space, so the differences across a 2x2
+	// pixel quad are the same for every quad of a face; they are the plane steps
+	// of the setup and are evaluated once per face instead of per quad.
+	void computeLOD(int iface, const TriangleSetup &tri)
+	{
+		Vector2f uvAB = (uv[3 * iface + 1] - uv[3 * iface + 0]).cast<float>(),
+			uvAC = (uv[3 * iface + 2] - uv[3 * iface + 0]).cast<float>();
+		Vector2f ddx = uvAB * tri.dvdx + uvAC * tri.dudx;
+		Vector2f ddy = uvAB * tri.dvdy + uvAC * tri.dudy;
+		float rho2 = std::max(ddx.squaredNorm(), ddy.squaredNorm()); // texels per pixel, squared
+		// nearest level: log2(rho) rounded, and level 0 while magnifying
+		int maxLevel = std::max(model->mipLevels() - 1, 0);
+		lod[iface] = rho2 > 2.0f ? std::min((int)(0.5f * std::log2(rho2) + 0.5f), maxLevel) : 0;
 	}
 	void setCameraPos(Vector3f pos) { cameraPos = pos; }
 	void setMatrix(const Matrix4f &modelMatrix, const Matrix4f &projectionMatrix, const Matrix4f &viewMatrix, const Matrix4f &cameraT)
 	{
 		T = viewPortMatrix * projectionMatrix * viewMatrix * modelMatrix;
+		this->modelMatrix = modelMatrix;
 		normalMatrix = modelMatrix.inverse().transpose();
 		matrixShadow = cameraT * T.inverse();
 	}
-	// TBNTB
-	void computeTBN(int iface)
+
+private:
+	template <class V>
+	static void regrow(V *&p, int n, int newN, FrameArena &arena)
 	{
-		Vector3f tangent, bitangent;
-		Vector3f edge1 = worldCoords[iface][1] - worldCoords[iface][0],
-			edge2 = worldCoords[iface][2] - worldCoords[iface][0];
-		Vector2i deltaUV1 = uv[iface][1] - uv[iface][0], deltaUV2 = uv[iface][2] - uv[iface][0];
-		float f = 1.0 / (deltaUV1.x() * deltaUV2.y() - deltaUV2.x() * deltaUV1.y());
-		tangent << f * (deltaUV2.y() * edge1.x() - deltaUV1.y() * edge2.x()),
-			f *(deltaUV2.y() * edge1.y() - deltaUV1.y() * edge2.y()),
-			f *(deltaUV2.y() * edge1.z() - deltaUV1.y() * edge2.z());
-		tangent.normalize();
-		bitangent << f * (-deltaUV2.x() * edge1.x() + deltaUV1.x() * edge2.x()),
-			f *(-deltaUV2.x() * edge1.y() + deltaUV1.x() * edge2.y()),
-			f *(-deltaUV2.x() * edge1.z() + deltaUV1.x() * edge2.z());
-		Vector3f T = transform(tangent, normalMatrix);
-		Vector3f B = transform(bitangent, normalMatrix);
-		T.normalize(), B.normalize();
-		TBN[iface].row(0) = T;
-		TBN[iface].row(1) = B;
+		V *q = arena.alloc<V>(newN);
+		std::copy(p, p + n, q);
+		p = q;
 	}
 };
 
 // ͼ
 // Ӱӳ
-class DepthShader : public FShader
+class DepthShader final : public FShader
 {
 public:
 	Matrix4f MVP;
 	Matrix4f viewPortMatrix;
-	vector < vector<Vector3f>> screenCoords;
+	Vector3f *screenCoords; // [3 * iface + nthvert], allocated from the frame arena
 	Model *model;
 
 	DepthShader(Matrix4f viewPort) :
 		viewPortMatrix(viewPort),
+		screenCoords(nullptr),
 		model(nullptr) { }
 
 	virtual Vector3f vertex(int iface, int nthvert)
 	{
-		Vector3f v = model->vert(iface, nthvert);
-		screenCoords[iface][nthvert] = transform(v, viewPortMatrix * MVP);
-		return screenCoords[iface][nthvert];
+		screenCoords[3 * iface + nthvert] = transformed[model->vertIndex(iface, nthvert)];
+		return screenCoords[3 * iface + nthvert];
 	}
 
+	// batch transform of all model vertices, call before vertex()
+	void transformVertices(ThreadPool &pool) { FShader::transformVertices(model, viewPortMatrix * MVP, pool); }
+
 	virtual Color fragment(int iface, std::pair<float, float> barycentricUV)
 	{
 		//float u = barycentricUV.first, v = barycentricUV.second;
@@ -200,11 +309,9 @@ public:
 		return Color();
 	}
 
-	void setModel(Model *m) { 
+	void setModel(Model *m, FrameArena &arena) { 
 		model = m; 
-		screenCoords.resize(m->nfaces());
-		for (int i = 0; i < m->nfaces(); ++i)
-			screenCoords[i].resize(3);
+		screenCoords = arena.alloc<Vector3f>(3 * m->nfaces());
 	}
 
 	void setMatrix(const Matrix4f &modelMatrix, const Matrix4f &projectionMatrix, const Matrix4f &viewMatrix)
@@ -0,0 +1,82 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include "Arena.h"
+
+// A 2D buffer of T in one cache line aligned allocation.
+// Rows are padded to a multiple of 64 bytes; pitch is the row stride in
+// elements. surface[row] returns the row pointer, so surface[row][x] indexes
+// like the row-pointer arrays it replaces. Row 0 is the top of the screen.
+template <class T>
+class Surface
+{
+public:
+	static const size_t ALIGNMENT = 64;
+
+	Surface() : data_(nullptr), width_(0), height_(0), pitch_(0), owned_(false) {}
+	Surface(int w, int h) : Surface() { allocate(w, h); }
+	// wrap external memory (e.g. a window's DIB section); pitch in elements
+	Surface(T *data, int w, int h, int pitch) : data_(data), width_(w), height_(h), pitch_(pitch), owned_(false) {}
+	~Surface() { release(); }
+	Surface(const Surface &) = delete;
+	Surface &operator=(const Surface &) = delete;
+
+	void allocate(int w, int h)
+	{
+		release();
+		size_t perLine = ALIGNMENT / sizeof(T);
+		width_ = w;
+		height_ = h;
+		pitch_ = (int)((w + perLine - 1) / perLine * perLine);
+		data_ = (T *)alignedMalloc(sizeof(T) * pitch_ * h, ALIGNMENT);
+		owned_ = true;
+	}
+
+	inline int getWidth() const { return width_; }
+	inline int getHeight() const { return height_; }
+	inline int getPitch() const { return pitch_; }
+	inline T *data() { return data_; }
+	inline const T *data() const { return data_; }
+	inline T *operator[](int row) { return data_ + (size_t)row * pitch_; }
+	inline const T *operator[](int row) const { return data_ + (size_t)row * pitch_; }
+
+	// whole surface; padding included so it is one contiguous, vectorizable fill
+	void clear(const T &value)
+	{
+		if (isByteFill(value))
+			memset(data_, *(const unsigned char *)&value, sizeof(T) * pitch_ * height_);
+		else
+			std::fill_n(data_, (size_t)pitch_ * height_, value);
+	}
+
+	// rows row0..row1 and columns x0..x1, inclusive
+	void clearRect(int x0, int row0, int x1, int row1, const T &value)
+	{
+		for (int r = row0; r <= row1; ++r)
+			std::fill((*this)[r] + x0, (*this)[r] + x1 + 1, value);
+	}
+
+private:
+	T *data_;
+	int width_;
+	int height_;
+	int pitch_;
+	bool owned_;
+
+	void release()
+	{
+		if (owned_)
+			alignedFree(data_);
+		data_ = nullptr;
+		owned_ = false;
+	}
+
+	static bool isByteFill(const T &value)
+	{
+		const unsigned char *b = (const unsigned char *)&value;
+		for (size_t i = 1; i < sizeof(T); ++i)
+			if (b[i] != b[0])
+				return false;
+		return true;
+	}
+};
@@ -0,0 +1,116 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "Arena.h"
+#include "ThreadPool.h"
+
+// A decoded, mipmapped texture of T texels.
+// Every level is one cache line aligned allocation. Texels are stored in 8x8
+// tiles, tiles in row-major order and the texels inside a tile in Morton (Z)
+// order, so a small 2D neighbourhood of the texture lands in a few cache lines
+// instead of one line per texture row.
+// Row 0 is v = 0, the image is flipped at decode time like the TGA data was.
+template <class T>
+class Texture
+{
+public:
+	static const size_t ALIGNMENT = 64;
+	static const int TILE_SHIFT = 3;
+	static const int TILE_SIZE = 1 << TILE_SHIFT;
+
+	Texture() {}
+	~Texture() { release(); }
+	Texture(const Texture &) = delete;
+	Texture &operator=(const Texture &) = delete;
+
+	// level 0 only, zero filled; width and height are padded up to whole tiles
+	void allocate(int w, int h)
+	{
+		release();
+		levels_.push_back(makeLevel(w, h));
+	}
+
+	// Builds levels 1..n down to 1x1 with a 2x2 box filter; average(a, b, c, d)
+	// combines four texels of the finer level. Odd sizes clamp at the edge.
+	// The rows of a level are split into tasks on pool.
+	template <class Average>
+	void buildMips(ThreadPool &pool, Average average)
+	{
+		const int ROWS_PER_TASK = 16;
+		levels_.resize(1);
+		while (levels_.back().width > 1 || levels_.back().height > 1)
+		{
+			const Level &src = levels_.back();
+			Level dst = makeLevel(std::max(src.width >> 1, 1), std::max(src.height >> 1, 1));
+			pool.wait(pool.parallelFor(0, dst.height, ROWS_PER_TASK, [&](int y) {
+				int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+				for (int x = 0; x < dst.width; ++x)
+				{
+					int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+					dst.texels[dst.offset(x, y)] = average(src.texels[src.offset(x0, y0)], src.texels[src.offset(x1, y0)],
+						src.texels[src.offset(x0, y1)], src.texels[src.offset(x1, y1)]);
+				}
+			}));
+			levels_.push_back(dst);
+		}
+	}
+
+	inline int getWidth() const { return levels_.empty() ? 0 : levels_[0].width; }
+	inline int getHeight() const { return levels_.empty() ? 0 : levels_[0].height; }
+	inline int levels() const { return (int)levels_.size(); }
+	inline bool empty() const { return levels_.empty(); }
+
+	inline T &at(int x, int y) { return levels_[0].texels[levels_[0].offset(x, y)]; }
+
+	// x, y in level 0 texels; coordinates outside the texture are clamped to the
+	// edge and level to the smallest mip
+	inline const T &fetch(int x, int y, int level = 0) const
+	{
+		const Level &l = levels_[std::min(level, (int)levels_.size() - 1)];
+		x = std::min(std::max(x >> level, 0), l.width - 1);
+		y = std::min(std::max(y >> level, 0), l.height - 1);
+		return l.texels[l.offset(x, y)];
+	}
+
+private:
+	struct Level
+	{
+		T *texels;
+		int width;
+		int height;
+		int tilesX;
+
+		inline size_t offset(int x, int y) const
+		{
+			size_t tile = (size_t)(y >> TILE_SHIFT) * tilesX + (x >> TILE_SHIFT);
+			int inner = spread3(x & (TILE_SIZE - 1)) | (spread3(y & (TILE_SIZE - 1)) << 1);
+			return (tile << (2 * TILE_SHIFT)) + inner;
+		}
+	};
+	std::vector<Level> levels_; // level 0 is the full resolution image
+
+	// spreads the low 3 bits of v to the even bit positions
+	static inline int spread3(int v) { return (v & 1) | ((v & 2) << 1) | ((v & 4) << 2); }
+
+	static Level makeLevel(int w, int h)
+	{
+		Level l;
+		l.width = w;
+		l.height = h;
+		l.tilesX = (w + TILE_SIZE - 1) >> TILE_SHIFT;
+		size_t count = (size_t)l.tilesX * ((h + TILE_SIZE - 1) >> TILE_SHIFT) * TILE_SIZE * TILE_SIZE;
+		l.texels = (T *)alignedMalloc(sizeof(T) * count, ALIGNMENT);
+		// zero bytes are zero for every texel type used, including Eigen
+		// vectors, whose T() leaves the values uninitialized
+		memset((void *)l.texels, 0, sizeof(T) * count);
+		return l;
+	}
+
+	void release()
+	{
+		for (Level &l : levels_)
+			alignedFree(l.texels);
+		levels_.clear();
+	}
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// Persistent work-stealing task scheduler.
+// Every worker owns a deque of ready tasks: it pops the newest task from its
+// own deque and, when that is empty, steals the oldest one from another
+// worker. A task may depend on earlier tasks and becomes ready when all of
+// them have finished, so stages are chained without a barrier in between.
+// The thread that submits tasks is slot 0 and runs tasks itself while it
+// waits; only that one thread may submit and wait.
+// Tasks live until waitAll() or releaseFinished(), so a Task pointer stays
+// valid as a dependency until then. Released tasks are kept for reuse, and
+// callables up to Task::INLINE_BYTES are stored in the task itself, so once
+// the pool has seen a frame's worth of tasks submitting does not allocate.
+class ThreadPool
+{
+public:
+	struct Task
+	{
+		static const size_t INLINE_BYTES = 128;
+		alignas(32) unsigned char storage[INLINE_BYTES];
+		void *fn; // the callable, in storage or on the heap
+		void (*run)(void *fn); // calls and then destroys fn
+		atomic<int> pending; // unfinished dependencies, plus one while submit() registers them
+		mutex lock; // guards done and successors
+		bool done;
+		vector<Task *> successors;
+	};
+
+	// tasks to depend on: none, one, or a list borrowed for the duration of the call
+	class Deps
+	{
+	public:
+		Deps() : tasks_(nullptr), one_(nullptr) {}
+		Deps(Task *task) : tasks_(nullptr), one_(task) {}
+		Deps(const vector<Task *> &tasks) : tasks_(&tasks), one_(nullptr) {}
+		Task *const *begin() const { return tasks_ ? tasks_->data() : &one_; }
+		Task *const *end() const { return tasks_ ? tasks_->data() + tasks_->size() : &one_ + (one_ != nullptr); }
+
+	private:
+		const vector<Task *> *tasks_;
+		Task *one_;
+	};
+
+	// threads counts the submitting thread too; 0 uses one per hardware thread.
+	// pinThreads binds worker i to the i-th core the creating thread may run on
+	// (wrapping around), leaving the first one to the submitting thread, which
+	// itself is never pinned. Cores are taken in the OS's numbering, without
+	// looking at the topology: on SMT machines neighbouring numbers can be
+	// siblings of one physical core.
+	explicit ThreadPool(int threads = 0, bool pinThreads = false);
+	~ThreadPool();
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	int size() const { return (int)queues_.size(); }
+
+	template <class F>
+	Task *submit(F fn, Deps deps = Deps())
+	{
+		Task *task = newTask();
+		if (sizeof(F) <= Task::INLINE_BYTES && alignof(F) <= alignof(Task))
+		{
+			task->fn = new (task->storage) F(std::move(fn));
+			task->run = [](void *f) { (*(F *)f)(); ((F *)f)->~F(); };
+		}
+		else
+		{
+			task->fn = new F(std::move(fn));
+			task->run = [](void *f) { (*(F *)f)(); delete (F *)f; };
+		}
+		schedule(task, deps);
+		return task;
+	}
+	// body(i) for i in begin..end-1 in chunks of grain iterations; the returned
+	// task finishes after the last chunk
+	template <class F>
+	Task *parallelFor(int begin, int end, int grain, F body, Deps deps = Deps())
+	{
+		chunks_.clear();
+		for (int b = begin; b < end; b += grain)
+		{
+			int e = std::min(b + grain, end);
+			chunks_.push_back(submit([=] { for (int i = b; i < e; ++i) body(i); }, deps));
+		}
+		return submit([] {}, chunks_);
+	}
+
+	void wait(Task *task); // runs tasks until task has finished
+	void waitAll(); // runs tasks until all have finished, then releases them
+	// releases the finished tasks but keep without waiting for the others, for
+	// callers that always have work in flight
+	void releaseFinished(Task *keep = nullptr);
+
+private:
+	// ring buffer of ready tasks; it grows but never shrinks
+	struct Queue
+	{
+		mutex lock;
+		vector<Task *> ring;
+		size_t head = 0, count = 0;
+
+		void push(Task *task);
+		Task *popNewest();
+		Task *popOldest();
+	};
+
+	vector<Queue *> queues_; // one per thread, slot 0 is the submitting thread
+	vector<thread> workers_;
+	vector<Task *> tasks_; // every task since the last waitAll(), owned by the submitting thread
+	vector<Task *> free_; // released tasks, reused by submit()
+	vector<Task *> chunks_; // parallelFor's scratch list
+	atomic<int> ready_; // tasks in the queues
+	atomic<int> unfinished_;
+	mutex sleepLock_;
+	condition_variable wake_;
+	bool stop_;
+
+	Task *newTask();
+	void schedule(Task *task, Deps deps);
+	void release(Task *task) { free_.push_back(task); }
+	void workerLoop(int slot);
+	bool runOne(int slot, bool oldestFirst = false);
+	void enqueue(Task *task);
+	void finish(Task *task);
+	static vector<int> allowedCores();
+	static void pinToCore(int core);
+};
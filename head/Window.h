@@ -17,7 +17,7 @@ static HWND screen_handle = NULL;		// 
 static HDC screen_dc = NULL;			// ׵ HDC
 static HBITMAP screen_hb = NULL;		// DIB
 static HBITMAP screen_ob = NULL;		// ϵ BITMAP
-unsigned char *screen_fb = NULL;		// frame buffer
+unsigned int *screen_fb = NULL;		// frame buffer
 long screen_pitch = 0;
 
 int screen_init(int w, int h, const TCHAR *title);	// Ļʼ
@@ -25,8 +25,6 @@ int screen_close(void);								// 
 void screen_dispatch(void);							// Ϣ
 void screen_update(void);							// ʾ FrameBuffer
 
-unsigned int **frameBuffer;
-
 // win32 event handler
 static LRESULT screen_events(HWND, UINT, WPARAM, LPARAM);
 
@@ -67,7 +65,7 @@ int screen_init(int w, int h, const TCHAR *title) {
 	if (screen_hb == NULL) return -3;
 
 	screen_ob = (HBITMAP)SelectObject(screen_dc, screen_hb);
-	screen_fb = (unsigned char *)ptr;
+	screen_fb = (unsigned int *)ptr;
 	screen_w = w;
 	screen_h = h;
 	screen_pitch = w * 4;
@@ -136,19 +134,3 @@ void screen_update(void) {
 	ReleaseDC(screen_handle, hDC);
 	screen_dispatch();
 }
-
-void init(int width, int height, void *fb)
-{
-	int need = sizeof(void *) * width * height * 4;
-	char *ptr = (char *)malloc(need);
-	char *framebuf, *zbuf;
-	assert(ptr);
-
-	frameBuffer = (IUINT32 **)ptr;
-	framebuf = (char *)ptr;
-	if (fb != NULL)
-		framebuf = (char *)fb;
-	for (int j = 0; j < height; j++) {
-		frameBuffer[j] = (IUINT32 *)(framebuf + width * 4 * j);
-	}
-}
\ No newline at end of file
@@ -2,39 +2,109 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <Eigen/Core>
 #include "Color.h"
 #include "tgaimage.h"
+#include "MappedFile.h"
+#include "Texture.h"
 //#include "geometry.h"
 using namespace Eigen;
 
+// Binary mesh cache (.srmesh): the header followed by flat little-endian arrays
+// of positions (float3), uvs (float2), normals (float3) and per face corner
+// vertex/uv/normal indices (int3, 3 corners per face). Offsets are in bytes
+// from the start of the file and 16 byte aligned, so the arrays are used in
+// place from a memory mapping. The cache is current while the .obj still has
+// the recorded modification time and size.
+struct MeshCacheHeader {
+	char magic[8]; // "SRMESH\0\0"
+	uint32_t version;
+	uint32_t nverts;
+	uint32_t nuvs;
+	uint32_t nnorms;
+	uint32_t nfaces;
+	uint32_t reserved;
+	uint64_t vertsOffset;
+	uint64_t uvsOffset;
+	uint64_t normsOffset;
+	uint64_t cornersOffset;
+	uint64_t tangentsOffset; // float4 per uv: tangent xyz, bitangent sign w
+	int64_t sourceModified; // of the .obj, in nanoseconds; see fileStamp()
+	int64_t sourceSize;
+};
+
 class Model {
 public:
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-	Model(const std::string& filename);
+	static const uint32_t MESH_CACHE_VERSION = 3;
+
+	// filename is an .obj or .srmesh file. For an .obj the mesh cache next to it
+	// is used when it was built from the .obj as it is now, and (re)written
+	// otherwise.
+	Model(const std::string& filename, bool loadTextures = true, bool useMeshCache = true);
 	~Model();
+	Model(const Model &) = delete;
+	Model &operator=(const Model &) = delete;
 	int nverts() const;
 	int nfaces() const;
 	Vector3f vert(const int& i) const;
 	Vector3f vert(const int &iface, const int &nthvert) const;
+	int vertIndex(const int &iface, const int &nthvert) const; // index into the vertex array
+	const Vector3f *vertData() const; // nverts() contiguous positions
+	int nuvs() const;
 	Vector2i uv(const int &iface, const int &nvert);
+	int uvIndex(const int &iface, const int &nvert) const;
+	// smoothed tangent frame per uv index: xyz is the tangent, orthogonal to the
+	// vertex normal, w = +-1 is the bitangent sign, B = w * cross(N, T)
+	const Vector4f *tangentData() const;
 	Vector3f normal(const int &iface, const int &nvert);
-	Vector3f normal(const Vector2i &uv);
-	Color diffuse(const Vector2i &uv);
+	// texture fetches take level 0 texel coordinates and a mip level
+	Vector3f normal(const Vector2i &uv, int level = 0);
+	Color diffuse(const Vector2i &uv, int level = 0);
 	Color diffuse(const Vector2f &uv);
 	//Color specular(Vector2i uv);
-	float specular(const Vector2i &uv);
+	float specular(const Vector2i &uv, int level = 0);
+	int mipLevels() const; // of the diffuse map
 	std::vector<int> face(int idx) const;
 
+	// writes a temporary file and renames it over filename, so processes that
+	// have the old cache mapped keep a complete mesh
+	bool writeMeshCache(const std::string &filename) const;
+	static std::string meshCachePath(const std::string &objFile); // foo.obj -> foo.srmesh
+
 private:
-	std::vector<Vector3f> verts_;
-	std::vector<std::vector<Vector3i>> faces_; // vector3i means vertex/uv/normal
-	std::vector<Vector3f> norms;
-	std::vector<Vector2f> uv_;
-	TGAImage diffusemap_;
-	TGAImage normalmap_;
-	TGAImage specularmap_;
-	void load_texture(std::string fileName, const char *suffix, TGAImage &img);
-};
+	// mesh arrays, pointing either into the owned vectors below (parsed .obj)
+	// or into meshFile_ (mapped cache)
+	const Vector3f *verts_;
+	const Vector2f *uv_;
+	const Vector3f *norms;
+	const Vector3i *faces_; // 3 per face, vector3i means vertex/uv/normal
+	const Vector4f *tangents_; // per uv
+	int nverts_;
+	int nuvs_;
+	int nnorms_;
+	int nfaces_;
+	long long sourceModified_; // stamp of the .obj the mesh came from, -1 if unknown
+	long long sourceSize_;
+
+	std::vector<Vector3f> ownedVerts_;
+	std::vector<Vector2f> ownedUvs_;
+	std::vector<Vector3f> ownedNorms_;
+	std::vector<Vector3i> ownedFaces_;
+	std::vector<Vector4f, aligned_allocator<Vector4f>> ownedTangents_;
+	MappedFile meshFile_;
 
+	// decoded once at load; a texture that failed to load is a single texel
+	// decoded from zero bytes, e.g. the normal (-1, -1, -1)
+	Texture<unsigned int> diffusemap_; // 0xAARRGGBB
+	Texture<Vector4f> normalmap_; // tangent space normal expanded to [-1, 1], w unused
+	Texture<unsigned char> specularmap_;
+	bool loadObj(const std::string &filename, ThreadPool &pool);
+	// checkSource rejects a cache built from another .obj than the stamp in sourceModified_/sourceSize_
+	bool loadMeshCache(const std::string &filename, bool checkSource = false);
+	void useOwnedArrays();
+	void computeTangents();
+	bool load_texture(std::string fileName, const char *suffix, TGAImage &img);
+};
@@ -2,12 +2,22 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <cstdlib>
 
 #include "head/model.h"
 #include "head/Renderer.h"
+#include "head/FramePipeline.h"
 #include "head/Camera.h"
 #include "head/Shader.h"
+#include "head/Offscreen.h"
+#include "head/Profiler.h"
+#if defined(_WIN32) && !defined(HEADLESS)
 #include "head/Window.h"
+#else
+#ifndef HEADLESS
+#define HEADLESS
+#endif
+#endif
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 using namespace std;
@@ -16,25 +26,58 @@ using namespace std::chrono;
 const int WIDTH = 800;
 const int HEIGHT = 800;
 
+// SR_THREADS sets the task pool size (default: one thread per core),
+// SR_PIN_THREADS=1 binds the pool threads to cores
+template <class R>
+static void configureThreads(R &renderer)
+{
+	const char *threads = getenv("SR_THREADS");
+	const char *pin = getenv("SR_PIN_THREADS");
+	if (threads || pin)
+		renderer.setThreadCount(threads ? atoi(threads) : 0, pin && atoi(pin) != 0);
+}
+
+// SR_PIPELINE=1 draws through a FramePipeline: the screen shows the frame
+// before the one just drawn, in exchange for overlapping the two.
+// Exactly one of renderer and pipeline is created, each with its own pool
+static void createRenderer(unsigned int *fb, Camera *camera, Vector3f lightPos, Renderer *&renderer, FramePipeline *&pipeline)
+{
+	const char *env = getenv("SR_PIPELINE");
+	renderer = nullptr;
+	pipeline = nullptr;
+	if (env && atoi(env) != 0)
+	{
+		pipeline = new FramePipeline(WIDTH, HEIGHT, fb, camera, lightPos);
+		configureThreads(*pipeline);
+	}
+	else
+	{
+		renderer = new Renderer(WIDTH, HEIGHT, fb, camera, lightPos);
+		configureThreads(*renderer);
+	}
+}
+
+#ifndef HEADLESS
 int main()
 {
 	TCHAR *title = _T("SimpleRenderer | WASD移动视角, QE缩放");
 	if (screen_init(WIDTH, HEIGHT, title))
 		return -1;
-	init(WIDTH, HEIGHT, screen_fb);
 
 	string model_path = "obj/african_head/african_head.obj";
 	//string model_path = "obj/diablo3_pose/diablo3_pose.obj";
 	Vector3f lightPos = Vector3f(1, 1, 1);
 	Camera *camera = new Camera();
 	Model model(model_path);
-	Renderer renderer(WIDTH, HEIGHT, frameBuffer, camera, lightPos);
+	Renderer *renderer;
+	FramePipeline *pipeline;
+	createRenderer(screen_fb, camera, lightPos, renderer, pipeline);
 
 	while (screen_exit == 0 && screen_keys[VK_ESCAPE] == 0)
 	{
 		auto start = steady_clock::now();
+		PROFILE_BEGIN_FRAME();
 		screen_dispatch();
-		renderer.bufferClear();
 
 		if (screen_keys[VK_RIGHT] || screen_keys['D'])
 			camera->move(Camera::Action::RIGHT);
@@ -50,13 +93,92 @@ int main()
 			camera->move(Camera::Action::ZOOM_OUT);
 
 		Matrix4f modelMatrix = Matrix4f::Identity();
-		renderer.drawModel(&model, Renderer::DrawMode::TRIANGLE, modelMatrix);
-		screen_update();
+		if (pipeline)
+			pipeline->drawFrame(&model, modelMatrix);
+		else
+		{
+			renderer->bufferClear();
+			renderer->drawModel(&model, Renderer::DrawMode::TRIANGLE, modelMatrix);
+		}
+		{
+			PROFILE_SCOPE("screen_update");
+			screen_update();
+		}
+		PROFILE_END_FRAME();
 		auto end = steady_clock::now();
 		double fps = 1.0 / duration<double>(end - start).count();
 		cout << "FPS: " << fps << '\r';
 	}
+	if (pipeline)
+		pipeline->flush();
 
+#ifdef PROFILING
+	Profiler::instance().writeChromeTrace("profile_trace.json");
+	Profiler::instance().writeFrameCSV("profile_frames.csv");
+#endif
+	delete pipeline;
+	delete renderer;
 	delete camera;
 	return 0;
 }
+#else
+// headless: SimpleRenderer [model.obj] [frames] [output.tga|output.raw]
+// the camera orbits to the right every frame and the last frame is written out
+int main(int argc, char **argv)
+{
+	string model_path = argc > 1 ? argv[1] : "obj/african_head/african_head.obj";
+	int frames = argc > 2 ? atoi(argv[2]) : 1;
+	string output = argc > 3 ? argv[3] : "output.tga";
+	if (frames < 1)
+		frames = 1;
+
+	OffscreenBuffer target(WIDTH, HEIGHT);
+	Vector3f lightPos = Vector3f(1, 1, 1);
+	Camera *camera = new Camera();
+	Model model(model_path);
+	Renderer *renderer;
+	FramePipeline *pipeline;
+	createRenderer(target.data(), camera, lightPos, renderer, pipeline);
+
+	double total = 0;
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		auto start = steady_clock::now();
+		PROFILE_BEGIN_FRAME();
+		if (frame > 0)
+			camera->move(Camera::Action::RIGHT);
+
+		Matrix4f modelMatrix = Matrix4f::Identity();
+		if (pipeline)
+			pipeline->drawFrame(&model, modelMatrix);
+		else
+		{
+			renderer->bufferClear();
+			renderer->drawModel(&model, Renderer::DrawMode::TRIANGLE, modelMatrix);
+		}
+		PROFILE_END_FRAME();
+		auto end = steady_clock::now();
+		total += duration<double>(end - start).count();
+	}
+	if (pipeline)
+	{
+		// the last frame is still in flight
+		auto start = steady_clock::now();
+		pipeline->flush();
+		total += duration<double>(steady_clock::now() - start).count();
+	}
+	cout << "frames: " << frames << "\tavg FPS: " << frames / total << endl;
+	Renderer::FrameStats stats = pipeline ? pipeline->getFrameStats() : renderer->getFrameStats();
+	cout << "fragments shaded (last frame): " << stats.fragmentsShaded << endl;
+
+#ifdef PROFILING
+	Profiler::instance().writeChromeTrace("profile_trace.json");
+	Profiler::instance().writeFrameCSV("profile_frames.csv");
+#endif
+	bool ok = target.write(output);
+	delete pipeline;
+	delete renderer;
+	delete camera;
+	return ok ? 0 : -1;
+}
+#endif
@@ -0,0 +1,77 @@
+#include "../head/FramePipeline.h"
+#include "../head/Profiler.h"
+
+#include <cstring>
+#include <Eigen/Dense>
+
+FramePipeline::FramePipeline(int w, int h, unsigned int *fb, Camera *camera, Vector3f lightDir, int fbPitch) :
+	screen_(fb, w, h, fbPitch > 0 ? fbPitch : w)
+{
+	width = w;
+	height = h;
+	pool_ = new ThreadPool();
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+	{
+		targets_[i].allocate(width, height);
+		renderers_[i] = new Renderer(width, height, targets_[i].data(), camera, lightDir, targets_[i].getPitch());
+		renderers_[i]->setThreadPool(pool_);
+	}
+	next_ = 0;
+	inFlight_ = nullptr;
+	stats_ = Renderer::FrameStats{ 0, 0 };
+	screen_.clear(0);
+}
+
+FramePipeline::~FramePipeline()
+{
+	flush();
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+		delete renderers_[i];
+	delete pool_;
+}
+
+void FramePipeline::setThreadCount(int threads, bool pinThreads)
+{
+	flush();
+	ThreadPool *old = pool_;
+	pool_ = new ThreadPool(threads, pinThreads);
+	for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+		renderers_[i]->setThreadPool(pool_);
+	delete old;
+}
+
+void FramePipeline::drawFrame(Model *model, Matrix4f modelMatrix)
+{
+	PROFILE_SCOPE("drawFrame");
+	Renderer &renderer = *renderers_[next_];
+	renderer.bufferClear(); // its last frame was presented in the previous call
+	ThreadPool::Task *done = renderer.submitModel(model, Renderer::DrawMode::TRIANGLE, modelMatrix);
+	// the previous frame's tiles were running during the setup above
+	present(1 - next_);
+	inFlight_ = done;
+	pool_->releaseFinished(inFlight_);
+	next_ = 1 - next_;
+}
+
+void FramePipeline::flush()
+{
+	present(1 - next_);
+	pool_->waitAll();
+}
+
+void FramePipeline::present(int i)
+{
+	if (!inFlight_)
+		return;
+	PROFILE_SCOPE("present");
+	const int ROWS_PER_TASK = 32;
+	const Surface<unsigned int> &target = targets_[i];
+	// waiting here rather than hanging every band off inFlight_ keeps its successor list short
+	pool_->wait(inFlight_);
+	pool_->wait(pool_->parallelFor(0, (height + ROWS_PER_TASK - 1) / ROWS_PER_TASK, 1, [&](int band) {
+		for (int row = band * ROWS_PER_TASK; row < min(height, band * ROWS_PER_TASK + ROWS_PER_TASK); ++row)
+			memcpy(screen_[row], target[row], sizeof(unsigned int) * width);
+	}));
+	stats_ = renderers_[i]->getFrameStats();
+	inFlight_ = nullptr;
+}
@@ -0,0 +1,139 @@
+#include "../head/MappedFile.h"
+
+#include <cstdio>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile() : data_(nullptr), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(NULL) {}
+#else
+MappedFile::MappedFile() : data_(nullptr), size_(0) {}
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string &filename)
+{
+	close();
+	file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file_ == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping_ == NULL)
+	{
+		close();
+		return false;
+	}
+	data_ = (const char *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+	if (!data_)
+	{
+		close();
+		return false;
+	}
+	size_ = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (data_)
+		UnmapViewOfFile(data_);
+	if (mapping_ != NULL)
+		CloseHandle(mapping_);
+	if (file_ != INVALID_HANDLE_VALUE)
+		CloseHandle(file_);
+	data_ = nullptr;
+	size_ = 0;
+	mapping_ = NULL;
+	file_ = INVALID_HANDLE_VALUE;
+}
+#else
+bool MappedFile::open(const std::string &filename)
+{
+	close();
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // the mapping keeps its own reference
+	if (p == MAP_FAILED)
+		return false;
+	data_ = (const char *)p;
+	size_ = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (data_)
+		munmap((void *)data_, size_);
+	data_ = nullptr;
+	size_ = 0;
+}
+#endif
+
+long long fileModifiedTime(const std::string &filename)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return -1;
+	return (long long)st.st_mtime;
+}
+
+bool fileStamp(const std::string &filename, long long &modified, long long &size)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+#if defined(_WIN32)
+	modified = (long long)st.st_mtime * 1000000000LL;
+#elif defined(__APPLE__)
+	modified = (long long)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+	modified = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+	size = (long long)st.st_size;
+	return true;
+}
+
+std::string tempFileName(const std::string &filename)
+{
+#ifdef _WIN32
+	return filename + ".tmp" + std::to_string(_getpid());
+#else
+	return filename + ".tmp" + std::to_string(getpid());
+#endif
+}
+
+bool replaceFile(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
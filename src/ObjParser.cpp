@@ -0,0 +1,277 @@
+#include "../head/ObjParser.h"
+#include "../head/MappedFile.h"
+#include "../head/ThreadPool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+void ObjMesh::clear()
+{
+	verts.clear();
+	uvs.clear();
+	norms.clear();
+	corners.clear();
+}
+
+namespace {
+
+const size_t MIN_CHUNK = 64 * 1024; // smaller files are not worth splitting
+
+inline const char *skipSpaces(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+	return p;
+}
+
+inline bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+bool scanInt(const char *&p, const char *end, int &out)
+{
+	const char *q = skipSpaces(p, end);
+	bool neg = false;
+	if (q < end && (*q == '-' || *q == '+'))
+		neg = *q++ == '-';
+	if (q >= end || !isDigit(*q))
+		return false;
+	int v = 0;
+	while (q < end && isDigit(*q))
+		v = v * 10 + (*q++ - '0');
+	out = neg ? -v : v;
+	p = q;
+	return true;
+}
+
+bool scanFloat(const char *&p, const char *end, float &out)
+{
+	// exact powers of ten; mantissa / 10^k is then correctly rounded for k <= 22
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const char *q = skipSpaces(p, end);
+	bool neg = false;
+	if (q < end && (*q == '-' || *q == '+'))
+		neg = *q++ == '-';
+	unsigned long long mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+	for (; q < end && isDigit(*q); ++q, any = true)
+	{
+		if (digits < 19)
+			mantissa = mantissa * 10 + (*q - '0'), ++digits;
+		else
+			++exponent;
+	}
+	if (q < end && *q == '.')
+	{
+		for (++q; q < end && isDigit(*q); ++q, any = true)
+		{
+			if (digits < 19)
+				mantissa = mantissa * 10 + (*q - '0'), ++digits, --exponent;
+		}
+	}
+	if (!any)
+		return false;
+	if (q < end && (*q == 'e' || *q == 'E'))
+	{
+		const char *e = q + 1;
+		int x;
+		if (scanInt(e, end, x))
+		{
+			exponent += x;
+			q = e;
+		}
+	}
+	double v = (double)mantissa;
+	while (exponent > 22) { v *= 1e22; exponent -= 22; }
+	while (exponent < -22) { v /= 1e22; exponent += 22; }
+	v = exponent >= 0 ? v * pow10[exponent] : v / pow10[-exponent];
+	out = (float)(neg ? -v : v);
+	p = q;
+	return true;
+}
+
+// same record types and face syntax (v/vt/vn) the stream parser accepts
+void parseLine(const char *p, const char *end, ObjMesh &mesh)
+{
+	if (end - p < 2)
+		return;
+	if (p[0] == 'v' && p[1] == ' ')
+	{
+		p += 2;
+		Vector3f v(0, 0, 0);
+		for (int i = 0; i < 3 && scanFloat(p, end, v[i]); ++i) {}
+		mesh.verts.push_back(v);
+	}
+	else if (p[0] == 'v' && p[1] == 'n' && end - p > 2 && p[2] == ' ')
+	{
+		p += 3;
+		Vector3f n(0, 0, 0);
+		for (int i = 0; i < 3 && scanFloat(p, end, n[i]); ++i) {}
+		mesh.norms.push_back(n);
+	}
+	else if (p[0] == 'v' && p[1] == 't' && end - p > 2 && p[2] == ' ')
+	{
+		p += 3;
+		Vector2f uv(0, 0);
+		for (int i = 0; i < 2 && scanFloat(p, end, uv[i]); ++i) {}
+		mesh.uvs.push_back(uv);
+	}
+	else if (p[0] == 'f' && p[1] == ' ')
+	{
+		p += 2;
+		// no limit on the polygon size; the buffer is reused, so only the
+		// largest polygon of each thread allocates
+		static thread_local std::vector<Vector3i> f;
+		f.clear();
+		for (;;)
+		{
+			Vector3i c;
+			if (!scanInt(p, end, c[0]) || p >= end || *p++ != '/' ||
+				!scanInt(p, end, c[1]) || p >= end || *p++ != '/' ||
+				!scanInt(p, end, c[2]))
+				break;
+			f.push_back(c - Vector3i(1, 1, 1)); // in wavefront obj all indices start at 1, not zero
+		}
+		int n = (int)f.size();
+		// polygons are stored as triangle fans
+		for (int i = 2; i < n; ++i)
+		{
+			mesh.corners.push_back(f[0]);
+			mesh.corners.push_back(f[i - 1]);
+			mesh.corners.push_back(f[i]);
+		}
+	}
+}
+
+void parseChunk(const char *p, const char *end, ObjMesh &mesh)
+{
+	while (p < end)
+	{
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		parseLine(p, eol, mesh);
+		p = eol + 1;
+	}
+}
+
+template <class T>
+void append(std::vector<T> &dst, const std::vector<T> &src)
+{
+	dst.insert(dst.end(), src.begin(), src.end());
+}
+
+} // namespace
+
+bool parseObj(const std::string &filename, ObjMesh &mesh, ThreadPool *pool)
+{
+	mesh.clear();
+	MappedFile file;
+	if (!file.open(filename))
+		return fileModifiedTime(filename) >= 0; // an empty file is a valid, empty mesh
+	const char *begin = file.data(), *end = begin + file.size();
+
+	int threads = pool ? pool->size() : 1;
+	int nchunks = (int)std::max<size_t>(1, std::min<size_t>(threads, file.size() / MIN_CHUNK));
+
+	// chunk boundaries are moved forward to the next line start
+	std::vector<const char *> bounds(nchunks + 1);
+	bounds[0] = begin;
+	bounds[nchunks] = end;
+	for (int i = 1; i < nchunks; ++i)
+	{
+		const char *p = std::max(begin + file.size() * i / nchunks, bounds[i - 1]);
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		bounds[i] = eol ? eol + 1 : end;
+	}
+
+	if (nchunks == 1)
+	{
+		parseChunk(begin, end, mesh);
+		return true;
+	}
+	std::vector<ObjMesh> parts(nchunks);
+	pool->wait(pool->parallelFor(0, nchunks, 1, [&](int i) { parseChunk(bounds[i], bounds[i + 1], parts[i]); }));
+
+	size_t nv = 0, nt = 0, nn = 0, nc = 0;
+	for (const ObjMesh &part : parts)
+	{
+		nv += part.verts.size();
+		nt += part.uvs.size();
+		nn += part.norms.size();
+		nc += part.corners.size();
+	}
+	mesh.verts.reserve(nv);
+	mesh.uvs.reserve(nt);
+	mesh.norms.reserve(nn);
+	mesh.corners.reserve(nc);
+	for (const ObjMesh &part : parts)
+	{
+		append(mesh.verts, part.verts);
+		append(mesh.uvs, part.uvs);
+		append(mesh.norms, part.norms);
+		append(mesh.corners, part.corners);
+	}
+	return true;
+}
+
+bool parseObjStream(const std::string &filename, ObjMesh &mesh)
+{
+	mesh.clear();
+	std::ifstream in;
+	in.open (filename, std::ifstream::in);
+	if (in.fail()) return false;
+	std::string line;
+	while (!in.eof()) {
+		std::getline(in, line);
+		std::istringstream iss(line.c_str());
+		char trash;
+		if (!line.compare(0, 2, "v ")) 
+		{
+			iss >> trash;
+			Vector3f v;
+			for (int i=0;i<3;i++) 
+				iss >> v[i];
+			mesh.verts.push_back(v);
+		} 
+		else if (!line.compare(0, 3, "vn "))
+		{
+			iss >> trash >> trash;
+			Vector3f n;
+			for (int i = 0; i < 3; i++)
+				iss >> n[i];
+			mesh.norms.push_back(n);
+		}
+		else if (!line.compare(0, 3, "vt "))
+		{
+			iss >> trash >> trash;
+			Vector2f uv;
+			for (int i = 0; i < 2; ++i)
+				iss >> uv[i];
+			mesh.uvs.push_back(uv);
+		}
+		else if (!line.compare(0, 2, "f ")) 
+		{
+			std::vector<Vector3i> f;
+			Vector3i tmp;
+			iss >> trash;
+			while (iss >> tmp[0] >> trash >> tmp[1] >> trash >> tmp[2]) {
+				for (int i = 0; i < 3; i++) tmp[i]--; // in wavefront obj all indices start at 1, not zero
+				f.push_back(tmp);
+			}
+			// polygons are stored as triangle fans
+			for (int i = 2; i < (int)f.size(); ++i) {
+				mesh.corners.push_back(f[0]);
+				mesh.corners.push_back(f[i - 1]);
+				mesh.corners.push_back(f[i]);
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,61 @@
+#include "../head/Offscreen.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+OffscreenBuffer::OffscreenBuffer(int w, int h) : width_(w), height_(h)
+{
+	pixels_ = new unsigned int[width_ * height_];
+	clear();
+}
+
+OffscreenBuffer::~OffscreenBuffer()
+{
+	delete[] pixels_;
+}
+
+void OffscreenBuffer::clear()
+{
+	memset(pixels_, 0, sizeof(unsigned int) * width_ * height_);
+}
+
+void OffscreenBuffer::toImage(TGAImage &img) const
+{
+	img = TGAImage(width_, height_, TGAImage::RGB);
+	unsigned char *dst = img.buffer();
+	for (int i = 0; i < width_ * height_; ++i)
+	{
+		unsigned int c = pixels_[i];
+		dst[i * 3 + 0] = c & 0xff;
+		dst[i * 3 + 1] = (c >> 8) & 0xff;
+		dst[i * 3 + 2] = (c >> 16) & 0xff;
+	}
+}
+
+bool OffscreenBuffer::writeTGA(const std::string &filename, bool rle) const
+{
+	// write_tga_file stores a top-left origin, which matches our row order
+	TGAImage img;
+	toImage(img);
+	return img.write_tga_file(filename.c_str(), rle);
+}
+
+bool OffscreenBuffer::writeRaw(const std::string &filename) const
+{
+	std::ofstream out(filename, std::ios::binary);
+	if (!out.is_open()) {
+		std::cerr << "can't open file " << filename << "\n";
+		return false;
+	}
+	out.write((const char *)pixels_, sizeof(unsigned int) * width_ * height_);
+	return out.good();
+}
+
+bool OffscreenBuffer::write(const std::string &filename) const
+{
+	size_t dot = filename.find_last_of(".");
+	if (dot != std::string::npos && filename.substr(dot) == ".raw")
+		return writeRaw(filename);
+	return writeTGA(filename);
+}
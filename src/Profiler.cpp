@@ -0,0 +1,140 @@
+#include "../head/Profiler.h"
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+
+static const char *counterNames[Profiler::COUNTER_COUNT] = {
+	"triangles submitted",
+	"triangles backface",
+	"triangles offscreen",
+	"pixels tested",
+	"fragments shaded"
+};
+
+Profiler &Profiler::instance()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+Profiler::~Profiler()
+{
+	for (ThreadData *d : threads_)
+		delete d;
+}
+
+Profiler::ThreadData *Profiler::registerThread()
+{
+	ThreadData *d = new ThreadData();
+	lock_guard<mutex> lock(mutex_);
+	d->id = (int)threads_.size();
+	threads_.push_back(d);
+	return d;
+}
+
+void Profiler::beginFrame()
+{
+	frameStart_ = now();
+}
+
+void Profiler::endFrame()
+{
+	Frame f;
+	f.start = frameStart_;
+	f.end = now();
+	memset(f.counters, 0, sizeof(f.counters));
+	lock_guard<mutex> lock(mutex_);
+	for (ThreadData *d : threads_)
+		for (int c = 0; c < COUNTER_COUNT; ++c)
+			f.counters[c] += d->counters[c].exchange(0, memory_order_relaxed);
+	frames_.push_back(f);
+	frame_.store((int)frames_.size(), memory_order_relaxed);
+}
+
+vector<const char *> Profiler::stageNames() const
+{
+	vector<const char *> names;
+	for (const ThreadData *d : threads_)
+		for (const Event &e : d->events)
+		{
+			bool found = false;
+			for (const char *n : names)
+				found = found || strcmp(n, e.name) == 0;
+			if (!found)
+				names.push_back(e.name);
+		}
+	return names;
+}
+
+// Trace Event Format: complete ("X") events per scope, one track per thread,
+// and a counter ("C") event per frame. Timestamps are in microseconds.
+bool Profiler::writeChromeTrace(const string &path) const
+{
+	ofstream out(path);
+	if (!out)
+		return false;
+	lock_guard<mutex> lock(mutex_);
+	out << fixed << setprecision(3);
+	out << "{\"traceEvents\":[";
+	bool first = true;
+	for (const ThreadData *d : threads_)
+		for (const Event &e : d->events)
+		{
+			out << (first ? "\n" : ",\n");
+			out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << d->id
+				<< ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << (e.end - e.start) / 1000.0
+				<< ",\"args\":{\"frame\":" << e.frame << "}}";
+			first = false;
+		}
+	for (const Frame &f : frames_)
+	{
+		out << (first ? "\n" : ",\n");
+		out << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":0,\"ts\":" << f.start / 1000.0 << ",\"args\":{";
+		for (int c = 0; c < COUNTER_COUNT; ++c)
+			out << (c ? "," : "") << "\"" << counterNames[c] << "\":" << f.counters[c];
+		out << "}}";
+		first = false;
+	}
+	out << "\n]}\n";
+	return (bool)out;
+}
+
+// a stage's time is the sum of its scopes in the frame over all threads, so
+// stages timed inside parallel loops report CPU time, not wall time
+bool Profiler::writeFrameCSV(const string &path) const
+{
+	ofstream out(path);
+	if (!out)
+		return false;
+	lock_guard<mutex> lock(mutex_);
+	vector<const char *> names = stageNames();
+	out << "frame,frame ms";
+	for (const char *n : names)
+		out << "," << n << " ms";
+	for (int c = 0; c < COUNTER_COUNT; ++c)
+		out << "," << counterNames[c];
+	out << "\n" << fixed << setprecision(3);
+
+	vector<vector<long long>> stageTime(frames_.size(), vector<long long>(names.size(), 0));
+	for (const ThreadData *d : threads_)
+		for (const Event &e : d->events)
+		{
+			if (e.frame >= (int)frames_.size())
+				continue; // recorded after the last endFrame()
+			for (size_t s = 0; s < names.size(); ++s)
+				if (strcmp(names[s], e.name) == 0)
+					stageTime[e.frame][s] += e.end - e.start;
+		}
+	for (size_t i = 0; i < frames_.size(); ++i)
+	{
+		const Frame &f = frames_[i];
+		out << i << "," << (f.end - f.start) / 1e6;
+		for (long long t : stageTime[i])
+			out << "," << t / 1e6;
+		for (int c = 0; c < COUNTER_COUNT; ++c)
+			out << "," << f.counters[c];
+		out << "\n";
+	}
+	return (bool)out;
+}
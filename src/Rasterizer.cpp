@@ -0,0 +1,225 @@
+#include "../head/Rasterizer.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RASTER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(RASTER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RASTER_TARGET_AVX2 __attribute__((target("avx2")))
+#define RASTER_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define RASTER_TARGET_AVX2
+#define RASTER_TARGET_SSE2
+#endif
+
+template <DepthTest TEST>
+static int spanScalar(const TriangleSetup &tri, int y, int x0, int x1, const float *depthRow, SpanFragment *out)
+{
+	float u, v, z;
+	tri.planeAt(x0, y, u, v, z);
+	int n = 0;
+	for (int x = x0; x <= x1; ++x, u += tri.dudx, v += tri.dvdx, z += tri.dzdx)
+	{
+		if (u >= 0 && v >= 0 && u + v <= 1)
+		{
+			float zz = z * z;
+			if (TEST == DepthTest::GREATER ? zz > depthRow[x] : zz == depthRow[x])
+				out[n++] = SpanFragment{ x, u, v, zz };
+		}
+	}
+	return n;
+}
+
+#ifdef RASTER_X86
+static inline int lowestBit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return (int)i;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+template <DepthTest TEST>
+RASTER_TARGET_SSE2
+static int spanSSE2(const TriangleSetup &tri, int y, int x0, int x1, const float *depthRow, SpanFragment *out)
+{
+	float u, v, z;
+	tri.planeAt(x0, y, u, v, z);
+	const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	__m128 uu = _mm_add_ps(_mm_set1_ps(u), _mm_mul_ps(lane, _mm_set1_ps(tri.dudx)));
+	__m128 vv = _mm_add_ps(_mm_set1_ps(v), _mm_mul_ps(lane, _mm_set1_ps(tri.dvdx)));
+	__m128 zv = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(lane, _mm_set1_ps(tri.dzdx)));
+	const __m128 du = _mm_set1_ps(4 * tri.dudx), dv = _mm_set1_ps(4 * tri.dvdx), dz = _mm_set1_ps(4 * tri.dzdx);
+
+	int n = 0;
+	for (int x = x0; x <= x1; x += 4)
+	{
+		__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmpge_ps(vv, zero)),
+			_mm_cmple_ps(_mm_add_ps(uu, vv), one));
+		int mask = _mm_movemask_ps(inside);
+		if (mask)
+		{
+			__m128 zz = _mm_mul_ps(zv, zv);
+			int remaining = x1 - x + 1;
+			__m128 depth;
+			if (remaining >= 4)
+				depth = _mm_loadu_ps(depthRow + x);
+			else
+			{
+				float tail[4] = { 0, 0, 0, 0 };
+				for (int i = 0; i < remaining; ++i)
+					tail[i] = depthRow[x + i];
+				depth = _mm_loadu_ps(tail);
+				mask &= (1 << remaining) - 1;
+			}
+			mask &= _mm_movemask_ps(TEST == DepthTest::GREATER ? _mm_cmpgt_ps(zz, depth) : _mm_cmpeq_ps(zz, depth));
+			if (mask)
+			{
+				float us[4], vs[4], zs[4];
+				_mm_storeu_ps(us, uu);
+				_mm_storeu_ps(vs, vv);
+				_mm_storeu_ps(zs, zz);
+				while (mask)
+				{
+					int i = lowestBit(mask);
+					out[n++] = SpanFragment{ x + i, us[i], vs[i], zs[i] };
+					mask &= mask - 1;
+				}
+			}
+		}
+		uu = _mm_add_ps(uu, du);
+		vv = _mm_add_ps(vv, dv);
+		zv = _mm_add_ps(zv, dz);
+	}
+	return n;
+}
+
+template <DepthTest TEST>
+RASTER_TARGET_AVX2
+static int spanAVX2(const TriangleSetup &tri, int y, int x0, int x1, const float *depthRow, SpanFragment *out)
+{
+	float u, v, z;
+	tri.planeAt(x0, y, u, v, z);
+	const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	__m256 uu = _mm256_add_ps(_mm256_set1_ps(u), _mm256_mul_ps(lane, _mm256_set1_ps(tri.dudx)));
+	__m256 vv = _mm256_add_ps(_mm256_set1_ps(v), _mm256_mul_ps(lane, _mm256_set1_ps(tri.dvdx)));
+	__m256 zv = _mm256_add_ps(_mm256_set1_ps(z), _mm256_mul_ps(lane, _mm256_set1_ps(tri.dzdx)));
+	const __m256 du = _mm256_set1_ps(8 * tri.dudx), dv = _mm256_set1_ps(8 * tri.dvdx), dz = _mm256_set1_ps(8 * tri.dzdx);
+
+	int n = 0;
+	for (int x = x0; x <= x1; x += 8)
+	{
+		__m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(uu, zero, _CMP_GE_OQ), _mm256_cmp_ps(vv, zero, _CMP_GE_OQ)),
+			_mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ));
+		int mask = _mm256_movemask_ps(inside);
+		if (mask)
+		{
+			__m256 zz = _mm256_mul_ps(zv, zv);
+			int remaining = x1 - x + 1;
+			__m256 depth;
+			if (remaining >= 8)
+				depth = _mm256_loadu_ps(depthRow + x);
+			else
+			{
+				// masked load so the tail never reads past the end of the row
+				__m256i loadMask = _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+				depth = _mm256_maskload_ps(depthRow + x, loadMask);
+				mask &= (1 << remaining) - 1;
+			}
+			mask &= _mm256_movemask_ps(TEST == DepthTest::GREATER ? _mm256_cmp_ps(zz, depth, _CMP_GT_OQ) : _mm256_cmp_ps(zz, depth, _CMP_EQ_OQ));
+			if (mask)
+			{
+				float us[8], vs[8], zs[8];
+				_mm256_storeu_ps(us, uu);
+				_mm256_storeu_ps(vs, vv);
+				_mm256_storeu_ps(zs, zz);
+				while (mask)
+				{
+					int i = lowestBit(mask);
+					out[n++] = SpanFragment{ x + i, us[i], vs[i], zs[i] };
+					mask &= mask - 1;
+				}
+			}
+		}
+		uu = _mm256_add_ps(uu, du);
+		vv = _mm256_add_ps(vv, dv);
+		zv = _mm256_add_ps(zv, dz);
+	}
+	return n;
+}
+
+static bool cpuHasAVX2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) // OS must save the ymm registers
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+bool isRasterISASupported(RasterISA isa)
+{
+	switch (isa)
+	{
+	case RasterISA::SCALAR:
+		return true;
+#ifdef RASTER_X86
+	case RasterISA::SSE2:
+		return true; // baseline on every x86 CPU we target
+	case RasterISA::AVX2:
+	{
+		static const bool avx2 = cpuHasAVX2();
+		return avx2;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+RasterISA bestRasterISA()
+{
+	if (isRasterISASupported(RasterISA::AVX2))
+		return RasterISA::AVX2;
+	if (isRasterISASupported(RasterISA::SSE2))
+		return RasterISA::SSE2;
+	return RasterISA::SCALAR;
+}
+
+SpanKernel getSpanKernel(RasterISA isa, DepthTest test)
+{
+	if (!isRasterISASupported(isa))
+		isa = bestRasterISA();
+	bool equal = test == DepthTest::EQUAL;
+	switch (isa)
+	{
+#ifdef RASTER_X86
+	case RasterISA::AVX2:
+		return equal ? spanAVX2<DepthTest::EQUAL> : spanAVX2<DepthTest::GREATER>;
+	case RasterISA::SSE2:
+		return equal ? spanSSE2<DepthTest::EQUAL> : spanSSE2<DepthTest::GREATER>;
+#endif
+	default:
+		return equal ? spanScalar<DepthTest::EQUAL> : spanScalar<DepthTest::GREATER>;
+	}
+}
@@ -1,4 +1,5 @@
 #include "../head/Renderer.h"
+#include "../head/Profiler.h"
 
 #include <cmath>
 #include <algorithm>
@@ -7,11 +8,11 @@
 #include <Eigen/Dense>
 #include <iostream>
 
-Renderer::Renderer(int w, int h, unsigned int** fb, Camera *camera, Vector3f lightDir)
+Renderer::Renderer(int w, int h, unsigned int *fb, Camera *camera, Vector3f lightDir, int fbPitch) :
+	frameBuffer_(fb, w, h, fbPitch > 0 ? fbPitch : w)
 {
 	width = w;
 	height = h;
-	frameBuffer_ = fb;
 	lightDir_ = lightDir;
 	camera_ = camera;
 
@@ -27,48 +28,162 @@ Renderer::Renderer(int w, int h, unsigned int** fb, Camera *camera, Vector3f lig
 		0,		0,			1.0/2.0, 1.0/2.0,
 		0,		0,			0,		 1;
 
-	depthMap = new unsigned int *[height];
-	shadowBuffer = new float *[height];
-	zBuffer = new float *[height];
-	for (int i = 0; i < height; ++i)
-	{
-		depthMap[i] = new unsigned int[width];
-		shadowBuffer[i] = new float[width];
-		zBuffer[i] = new float[width];
-	}
-
-	bufferClear();
-
-	shader = new Shader(viewPortMatrix_, lightDir_, shadowBuffer, height, width);
+	depthMap = nullptr;
+	gFace = nullptr;
+	gBary = nullptr;
+	shadowValid_ = false;
+	shadowModel_ = nullptr;
+	shadowBuffer.allocate(width, height);
+	zBuffer.allocate(width, height);
+
+	tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	occlusionCulling_ = true;
+	depthPrepass_ = false;
+	prepassFragments_ = 0;
+	fragmentsShaded_ = 0;
+	pool_ = new ThreadPool();
+	ownsPool_ = true;
+	hiZ.allocate(tilesX * TILE_SIZE / HIZ_BLOCK, tilesY * TILE_SIZE / HIZ_BLOCK);
+	hiZ.clear(zFar_);
+	hiZStale.allocate(hiZ.getWidth(), hiZ.getHeight());
+	hiZStale.clear(0);
+	tileMinZ.assign(tilesX * tilesY, zFar_);
+	tileBins.resize(tilesX * tilesY);
+	shadowBins.resize(tilesX * tilesY);
+	tileNeedsClear.assign(tilesX * tilesY, 0);
+	tileDirty.assign(tilesX * tilesY, 0);
+	directWrite_ = false;
+	frameBuffer_.clear(0);
+	zBuffer.clear(zFar_);
+	shadowBuffer.clear(0);
+
+	shader = new Shader(viewPortMatrix_, lightDir_, &shadowBuffer, height, width);
 	depthShader = new DepthShader(viewPortMatrix_);
-	omp_init_lock(&mylock);
+
+	setRasterISA(bestRasterISA());
 }
 
 Renderer::~Renderer()
 {
-	for (int i = 0; i < height; ++i)
-	{
-		delete[] depthMap[i];
-		delete[] shadowBuffer[i];
-		delete[] zBuffer[i];
-	}
+	setShadowDebugView(false);
+	setDeferredShading(false);
 	delete shader;
 	delete depthShader;
-	delete zBuffer;
-	omp_destroy_lock(&mylock);
+	if (ownsPool_)
+		delete pool_;
+}
+
+void Renderer::setLightDir(Vector3f lightDir)
+{
+	lightDir_ = lightDir;
+	shader->lightDir = lightDir;
+}
+
+void Renderer::setShadowDebugView(bool enable)
+{
+	if (enable && !depthMap)
+	{
+		depthMap = new Surface<unsigned int>(width, height);
+		depthMap->clear(0);
+		invalidateShadowMap(); // fill it on the next draw
+	}
+	else if (!enable && depthMap)
+	{
+		delete depthMap;
+		depthMap = nullptr;
+	}
+}
+
+void Renderer::setDeferredShading(bool enable)
+{
+	if (enable && !gFace)
+	{
+		gFace = new Surface<int>(width, height);
+		gFace->clear(-1);
+		gBary = new Surface<Vector2f>(width, height);
+	}
+	else if (!enable && gFace)
+	{
+		delete gFace;
+		delete gBary;
+		gFace = nullptr;
+		gBary = nullptr;
+	}
+}
+
+void Renderer::setThreadCount(int threads, bool pinThreads)
+{
+	if (ownsPool_)
+		delete pool_;
+	pool_ = new ThreadPool(threads, pinThreads);
+	ownsPool_ = true;
+}
+
+void Renderer::setThreadPool(ThreadPool *pool)
+{
+	if (ownsPool_)
+		delete pool_;
+	pool_ = pool;
+	ownsPool_ = false;
+}
+
+void Renderer::setRasterISA(RasterISA isa)
+{
+	rasterISA_ = isRasterISASupported(isa) ? isa : bestRasterISA();
+	spanKernel_ = getSpanKernel(rasterISA_);
+	spanKernelEqual_ = getSpanKernel(rasterISA_, DepthTest::EQUAL);
 }
 
 void Renderer::bufferClear()
 {
-	for (int i = 0; i < height; ++i)
-		for (int j = 0; j < width; ++j)
-		{
-			frameBuffer_[i][j] = 0;
-			zBuffer[i][j] = zFar_;
+	PROFILE_SCOPE("bufferClear");
+	for (int t = 0; t < tilesX * tilesY; ++t)
+		if (tileDirty[t])
+			tileNeedsClear[t] = 1;
+	directWrite_ = false;
+	prepassFragments_ = 0;
+	fragmentsShaded_ = 0;
+}
 
-			depthMap[i][j] = 0;
-			shadowBuffer[i][j] = zFar_;
-		}
+void Renderer::clearTile(int t)
+{
+	int minX, minY, maxX, maxY;
+	tileRect(t, minX, minY, maxX, maxY);
+	frameBuffer_.clearRect(minX, height - maxY, maxX, height - minY, 0);
+	zBuffer.clearRect(minX, height - maxY, maxX, height - minY, zFar_);
+	hiZ.clearRect(minX / HIZ_BLOCK, (height - maxY) / HIZ_BLOCK, maxX / HIZ_BLOCK, (height - minY) / HIZ_BLOCK, zFar_);
+	hiZStale.clearRect(minX / HIZ_BLOCK, (height - maxY) / HIZ_BLOCK, maxX / HIZ_BLOCK, (height - minY) / HIZ_BLOCK, 0);
+	tileMinZ[t] = zFar_;
+	tileNeedsClear[t] = 0;
+	tileDirty[t] = 0;
+}
+
+void Renderer::flushClears()
+{
+	pool_->wait(pool_->parallelFor(0, tilesX * tilesY, 1, [this](int t) {
+		if (tileNeedsClear[t])
+			clearTile(t);
+	}));
+}
+
+// the raster tasks clear their own tiles, so these can run at the same time
+ThreadPool::Task *Renderer::clearUnusedTiles()
+{
+	tileTasks_.clear();
+	for (int t = 0; t < tilesX * tilesY; ++t)
+		if (tileNeedsClear[t] && tileBins[t].empty())
+			tileTasks_.push_back(pool_->submit([this, t] { clearTile(t); }));
+	return pool_->submit([] {}, tileTasks_);
+}
+
+// set(), drawLine() and the non-tiled drawTriangle() overloads may write any
+// pixel, so finish the pending clears and treat every tile as drawn to
+void Renderer::flushForDirectWrite()
+{
+	flushClears();
+	std::fill(tileDirty.begin(), tileDirty.end(), 1);
+	directWrite_ = true;
 }
 
 
@@ -132,6 +247,7 @@ void Renderer::drawTriangle(Vector2i t0, Vector2i t1, Vector2i t2, const Color&
 // Ļά
 void Renderer::drawTriangle(Vector3f t0, Vector3f t1, Vector3f t2, const Color &color)
 {
+	prepareDirectWrite();
 	int max_x = max(max(t0.x(), t1.x()), t2.x());
 	int min_x = min(min(t0.x(), t1.x()), t2.x());
 	int max_y = max(max(t0.y(), t1.y()), t2.y());
@@ -159,89 +275,622 @@ void Renderer::drawTriangle(Vector3f t0, Vector3f t1, Vector3f t2, const Color &
 }
 
 // ʹshader
-void Renderer::drawTriangle(Vector3f screenCoords[3], FShader *shader, int iface, unsigned int **frameBuffer, float **zBuffer)
+void Renderer::drawTriangle(Vector3f screenCoords[3], FShader *shader, int iface, Surface<unsigned int> &frameBuffer, Surface<float> &zBuffer)
 {
-	int max_x = min((int)max(max(screenCoords[0].x(), screenCoords[1].x()), screenCoords[2].x()), width - 1);
-	int min_x = max((int)min(min(screenCoords[0].x(), screenCoords[1].x()), screenCoords[2].x()), 0);
-	int max_y = min((int)max(max(screenCoords[0].y(), screenCoords[1].y()), screenCoords[2].y()), height);
-	int min_y = max((int)min(min(screenCoords[0].y(), screenCoords[1].y()), screenCoords[2].y()), 1);
+	TriangleSetup tri;
+	if (!tri.setup(screenCoords, 0, 1, width - 1, height))
+		return;
+	drawTriangle(tri, shader, iface, frameBuffer, zBuffer, tri.minX, tri.minY, tri.maxX, tri.maxY);
+}
 
-	for (int y = min_y; y <= max_y; ++y)
+// virtual fragment() call per pixel, kept for arbitrary FShader implementations
+void Renderer::drawTriangle(const TriangleSetup &tri, FShader *shader, int iface, Surface<unsigned int> &frameBuffer, Surface<float> &zBuffer,
+	int minX, int minY, int maxX, int maxY)
+{
+	prepareDirectWrite();
+	rasterizeTriangle(tri, shader, iface, frameBuffer, zBuffer, minX, minY, maxX, maxY, spanKernel_);
+}
+
+template <class ShaderT>
+int Renderer::rasterizeTriangleHiZ(const TriangleSetup &tri, ShaderT *shader, int iface, Surface<unsigned int> &frameBuffer, Surface<float> &zBuffer,
+	int minX, int minY, int maxX, int maxY, bool &refreshed)
+{
+	minX = max(minX, tri.minX);
+	maxX = min(maxX, tri.maxX);
+	minY = max(minY, tri.minY);
+	maxY = min(maxY, tri.maxY);
+	const int B = HIZ_BLOCK;
+	const int bc0 = minX / B, bc1 = maxX / B; // at most TILE_SIZE / B blocks, the rectangle is inside one tile
+	int shaded = 0;
+	refreshed = false;
+
+	SpanFragment frags[SPAN_MAX];
+	for (int br = (height - maxY) / B; br <= (height - minY) / B; ++br)
 	{
-		for (int x = min_x; x <= max_x; ++x)
+		// rows br * B .. br * B + B - 1 are y = height - row
+		int y0 = max(minY, height - (br * B + B - 1)), y1 = min(maxY, height - br * B);
+		unsigned int pass = 0; // blocks of this band the triangle may still be visible in
+		for (int bc = bc0; bc <= bc1; ++bc)
 		{
-			Vector2i p(x, y);
-			pair<float, float> uv = barycentric(screenCoords[0], screenCoords[1], screenCoords[2], p);
-			float u = uv.first, v = uv.second;
-			if (u >= 0 && v >= 0 && u + v <= 1)
+			if (hiZStale[br][bc])
 			{
-				Vector3f AB = screenCoords[1] - screenCoords[0],
-					AC = screenCoords[2] - screenCoords[0];
-				Vector3f p3f = screenCoords[0] + v * AB + u * AC;
-
-				float z = p3f.z();
-				z = z * z;
-				if (z > zBuffer[height - y][x])
+				hiZ[br][bc] = blockMinZ(br, bc);
+				hiZStale[br][bc] = 0;
+				refreshed = true;
+			}
+			if (tri.nearestDepth(max(minX, bc * B), y0, min(maxX, bc * B + B - 1), y1) > hiZ[br][bc])
+				pass |= 1u << (bc - bc0);
+		}
+		if (!pass)
+			continue;
+		for (int y = y0; y <= y1; ++y)
+		{
+			unsigned int *colorRow = frameBuffer[height - y];
+			float *depthRow = zBuffer[height - y];
+			// runs of neighbouring passing blocks go to the kernel as one span
+			for (int bc = bc0; bc <= bc1; ++bc)
+			{
+				if (!(pass >> (bc - bc0) & 1))
+					continue;
+				int end = bc;
+				while (end < bc1 && (pass >> (end + 1 - bc0) & 1))
+					++end;
+				int x0 = max(minX, bc * B), x1 = min(maxX, end * B + B - 1);
+				PROFILE_COUNT(PIXELS_TESTED, x1 - x0 + 1);
+				int n = spanKernel_(tri, y, x0, x1, depthRow, frags);
+				shaded += n;
+				for (int i = 0; i < n; ++i)
 				{
-					Color color = shader->fragment(iface, uv);
-					zBuffer[height - y][x] = z;
-					frameBuffer[height - y][x] = color.hex;
+					const SpanFragment &f = frags[i];
+					Color color = shader->fragment(iface, pair<float, float>(f.u, f.v));
+					depthRow[f.x] = f.z;
+					colorRow[f.x] = color.hex;
+					hiZStale[br][f.x / B] = 1;
 				}
+				bc = end;
+			}
+		}
+	}
+	return shaded;
+}
+
+float Renderer::blockMinZ(int br, int bc)
+{
+	int row1 = min(br * HIZ_BLOCK + HIZ_BLOCK, height), x1 = min(bc * HIZ_BLOCK + HIZ_BLOCK, width);
+	float m = zBuffer[br * HIZ_BLOCK][bc * HIZ_BLOCK];
+	for (int r = br * HIZ_BLOCK; r < row1; ++r)
+	{
+		const float *row = zBuffer[r];
+		for (int x = bc * HIZ_BLOCK; x < x1; ++x)
+			m = min(m, row[x]);
+	}
+	return m;
+}
+
+template <class ShaderT>
+int Renderer::rasterizeTriangle(const TriangleSetup &tri, ShaderT *shader, int iface, Surface<unsigned int> &frameBuffer, Surface<float> &zBuffer,
+	int minX, int minY, int maxX, int maxY, SpanKernel kernel)
+{
+	minX = max(minX, tri.minX);
+	maxX = min(maxX, tri.maxX);
+	minY = max(minY, tri.minY);
+	maxY = min(maxY, tri.maxY);
+
+	int shaded = 0;
+	SpanFragment frags[SPAN_MAX];
+	for (int y = minY; y <= maxY; ++y)
+	{
+		unsigned int *colorRow = frameBuffer[height - y];
+		float *depthRow = zBuffer[height - y];
+		// the kernel re-evaluates the planes at the start of every span so the x steps never drift far
+		for (int x0 = minX; x0 <= maxX; x0 += SPAN_MAX)
+		{
+			int x1 = min(x0 + SPAN_MAX - 1, maxX);
+			PROFILE_COUNT(PIXELS_TESTED, x1 - x0 + 1);
+			int n = kernel(tri, y, x0, x1, depthRow, frags);
+			shaded += n;
+			for (int i = 0; i < n; ++i)
+			{
+				const SpanFragment &f = frags[i];
+				Color color = shader->fragment(iface, pair<float, float>(f.u, f.v));
+				depthRow[f.x] = f.z;
+				colorRow[f.x] = color.hex;
+			}
+		}
+	}
+	return shaded;
+}
+
+// same spans as rasterizeTriangle, so the depths it stores are bit-identical
+// to the ones the equal test of the shading pass computes
+int Renderer::rasterizeDepth(const TriangleSetup &tri, Surface<float> &zBuffer, int minX, int minY, int maxX, int maxY)
+{
+	minX = max(minX, tri.minX);
+	maxX = min(maxX, tri.maxX);
+	minY = max(minY, tri.minY);
+	maxY = min(maxY, tri.maxY);
+
+	int passed = 0;
+	SpanFragment frags[SPAN_MAX];
+	for (int y = minY; y <= maxY; ++y)
+	{
+		float *depthRow = zBuffer[height - y];
+		for (int x0 = minX; x0 <= maxX; x0 += SPAN_MAX)
+		{
+			int x1 = min(x0 + SPAN_MAX - 1, maxX);
+			PROFILE_COUNT(PIXELS_TESTED, x1 - x0 + 1);
+			int n = spanKernel_(tri, y, x0, x1, depthRow, frags);
+			passed += n;
+			for (int i = 0; i < n; ++i)
+				depthRow[frags[i].x] = frags[i].z;
+		}
+	}
+	return passed;
+}
+
+// rasterizeDepth that also records the face and its barycentrics
+int Renderer::rasterizeGBuffer(const TriangleSetup &tri, int iface, int minX, int minY, int maxX, int maxY)
+{
+	minX = max(minX, tri.minX);
+	maxX = min(maxX, tri.maxX);
+	minY = max(minY, tri.minY);
+	maxY = min(maxY, tri.maxY);
+
+	int passed = 0;
+	SpanFragment frags[SPAN_MAX];
+	for (int y = minY; y <= maxY; ++y)
+	{
+		float *depthRow = zBuffer[height - y];
+		int *faceRow = (*gFace)[height - y];
+		Vector2f *baryRow = (*gBary)[height - y];
+		for (int x0 = minX; x0 <= maxX; x0 += SPAN_MAX)
+		{
+			int x1 = min(x0 + SPAN_MAX - 1, maxX);
+			PROFILE_COUNT(PIXELS_TESTED, x1 - x0 + 1);
+			int n = spanKernel_(tri, y, x0, x1, depthRow, frags);
+			passed += n;
+			for (int i = 0; i < n; ++i)
+			{
+				const SpanFragment &f = frags[i];
+				depthRow[f.x] = f.z;
+				faceRow[f.x] = iface;
+				baryRow[f.x] = Vector2f(f.u, f.v);
 			}
 		}
 	}
+	return passed;
 }
 
 void Renderer::drawModel(Model *model, DrawMode mode, Matrix4f modelMatrix)
+{
+	PROFILE_SCOPE("drawModel");
+	submitModel(model, mode, modelMatrix);
+	PROFILE_SCOPE("wait");
+	pool_->waitAll();
+}
+
+ThreadPool::Task *Renderer::submitModel(Model *model, DrawMode mode, Matrix4f modelMatrix)
 {
 	this->model = model;
 	Matrix4f cameraProjectionMatrix = computeProjectionMatrix(width, height, M_PI / 2, zNear_, zFar_);
 	Camera lightCamera(lightDir_);
 
-	shader->setModel(model);
+	arena_.reset();
+	shader->setModel(model, arena_);
 	shader->setCameraPos(camera_->getPos());
 	Matrix4f cameraT = viewPortMatrix_ * cameraProjectionMatrix * lightCamera.getViewMatrix() * modelMatrix;
 	shader->setMatrix(modelMatrix, projectionMatrix_, camera_->getViewMatrix(), cameraT);
 
-	depthShader->setModel(model);
-	depthShader->setMatrix(modelMatrix, cameraProjectionMatrix, lightCamera.getViewMatrix());
+	// the shadow map only depends on the model and the light transform, which
+	// includes the model matrix; reuse last frame's map when neither changed.
+	// Its raster tasks overlap the color pass' setup, only shading waits for them
+	shadowDone_.clear();
+	if (!shadowValid_ || model != shadowModel_ || cameraT != shadowT_)
+	{
+		PROFILE_SCOPE("shadow map");
+		shadowDone_.push_back(renderShadowMap(modelMatrix, cameraProjectionMatrix, lightCamera.getViewMatrix()));
+		shadowValid_ = true;
+		shadowModel_ = model;
+		shadowT_ = cameraT;
+	}
+
+	// vertex stage: each unique vertex is transformed once per pass
+	{
+		PROFILE_SCOPE("vertex");
+		shader->transformVertices(*pool_);
+	}
+
+	int nfaces = model->nfaces();
+	PROFILE_COUNT(TRIANGLES_SUBMITTED, nfaces);
+	triangles.resize(nfaces);
+	triVisible.resize(nfaces);
+	needsClip.assign(nfaces, false);
+	{
+		PROFILE_SCOPE("primitive setup");
+		pool_->wait(pool_->parallelFor(0, nfaces, 256, [&](int i) {
+			Vector3f screenCoords[3];
+			Vector4f clipCoords[3];
+			for (int j = 0; j < 3; ++j)
+			{
+				screenCoords[j] = shader->vertex(i, j);
+				clipCoords[j] = shader->clipCoord(model->vertIndex(i, j));
+			}
+			triVisible[i] = false;
+			// faces entirely off screen or behind the near plane are dropped here,
+			// faces crossing the near plane or the guard band are clipped afterwards
+			ClipResult clip = classifyTriangle(clipCoords);
+			if (clip == ClipResult::OUTSIDE)
+			{
+				PROFILE_COUNT(TRIANGLES_OFFSCREEN, 1);
+				return;
+			}
+			if (clip == ClipResult::CLIP)
+			{
+				needsClip[i] = true;
+				return;
+			}
+			// ޳
+			if (culling(screenCoords))
+			{
+				PROFILE_COUNT(TRIANGLES_BACKFACE, 1);
+				return;
+			}
+			if (!triangles[i].setup(screenCoords, 0, 1, width - 1, height))
+				return;
+			shader->computeLOD(i, triangles[i]);
+			triVisible[i] = true;
+		}));
+	}
+	clipTriangles(nfaces);
+	binTriangles(triangles, triVisible, tileBins, occlusionCulling_);
+	// the shadow map is part of the frame even if no tile is drawn to
+	frameDone_ = shadowDone_;
+	frameDone_.push_back(clearUnusedTiles()); // tiles nothing is drawn to this frame, alongside the raster tasks
+	if (getDeferredShading())
+	{
+		// the G-buffer does not read the shadow map, only its resolve does
+		shadowDone_.push_back(rasterizeGBufferTiles());
+		frameDone_.push_back(resolveGBuffer(shadowDone_));
+	}
+	else
+		frameDone_.push_back(rasterizeTiles(shader, shadowDone_));
+	return pool_->submit([] {}, frameDone_);
+}
+
+// The setup is finished on return; the raster tasks may still be running.
+ThreadPool::Task *Renderer::renderShadowMap(const Matrix4f &modelMatrix, const Matrix4f &lightProjection, const Matrix4f &lightView)
+{
+	int nfaces = model->nfaces();
+	{
+		PROFILE_SCOPE("shadow vertex");
+		depthShader->setModel(model, arena_);
+		depthShader->setMatrix(modelMatrix, lightProjection, lightView);
+		depthShader->transformVertices(*pool_);
+
+		shadowTriangles.resize(nfaces);
+		shadowVisible.resize(nfaces);
+		pool_->wait(pool_->parallelFor(0, nfaces, 256, [&](int i) {
+			Vector3f screenCoords[3];
+			for (int j = 0; j < 3; ++j)
+			{
+				screenCoords[j] = depthShader->vertex(i, j);
+			}
+			// ӿеͼԪ
+			shadowVisible[i] = (isInWindow(screenCoords[0]) ||
+				isInWindow(screenCoords[1]) ||
+				isInWindow(screenCoords[2])) &&
+				shadowTriangles[i].setup(screenCoords, 0, 1, width - 1, height);
+		}));
+	}
+	binTriangles(shadowTriangles, shadowVisible, shadowBins);
+	ThreadPool::Task *done = rasterizeShadowTiles();
+	if (depthMap)
+		done = pool_->submit([this] { fillShadowDebugView(); }, { done });
+	return done;
+}
 
-	// render shadow map
-#pragma omp parallel for num_threads(8)
-	for (int i = 0; i < model->nfaces(); ++i)
+// Plane distances in viewport space before the divide, positive inside. The
+// viewport matrix keeps w, so w is the view depth and the near plane is
+// w = -zNear; the window edges are x = 0, x = width * w and likewise for y.
+Renderer::ClipResult Renderer::classifyTriangle(const Vector4f h[3]) const
+{
+	const float nearW = -zNear_, g = (float)GUARD_BAND;
+	unsigned int outAll = ~0u, outAny = 0;
+	for (int k = 0; k < 3; ++k)
 	{
-		Vector3f screenCoords[3];
-		for (int j = 0; j < 3; ++j)
+		float x = h[k].x(), y = h[k].y(), w = h[k].w();
+		unsigned int out = 0;
+		if (w < nearW) out |= 1;
+		if (x < 0) out |= 2;
+		if (x > width * w) out |= 4;
+		if (y < 0) out |= 8;
+		if (y > height * w) out |= 16;
+		if (x < -g * w || x > (width + g) * w || y < -g * w || y > (height + g) * w)
+			out |= 32; // outside the guard band
+		outAll &= out;
+		outAny |= out;
+	}
+	if (outAll & 31)
+		return ClipResult::OUTSIDE;
+	return (outAny & (1 | 32)) ? ClipResult::CLIP : ClipResult::INSIDE;
+}
+
+// Sutherland-Hodgman against the near plane and the guard band, then a fan of
+// triangles per clipped polygon. The pieces become extra faces after the
+// model's own, with their corner varyings interpolated from the source face.
+// Only faces crossing those planes get here, so it runs serially.
+void Renderer::clipTriangles(int nfaces)
+{
+	struct ClipVertex { Vector4f h; Vector3f bary; };
+	const float nearW = -zNear_, g = (float)GUARD_BAND;
+	auto distance = [&](const Vector4f &h, int plane) -> float {
+		switch (plane)
 		{
-			screenCoords[j] = depthShader->vertex(i, j);
+		case 0: return h.w() - nearW;
+		case 1: return h.x() + g * h.w();
+		case 2: return (width + g) * h.w() - h.x();
+		case 3: return h.y() + g * h.w();
+		default: return (height + g) * h.w() - h.y();
 		}
-		// ӿеͼԪ
-		if (!isInWindow(screenCoords[0]) && 
-			!isInWindow(screenCoords[1]) &&
-			!isInWindow(screenCoords[2]))
+	};
+
+	PROFILE_SCOPE("clip");
+	int nclip = (int)std::count(needsClip.begin(), needsClip.end(), (char)true);
+	if (nclip == 0)
+		return;
+	int capacity = nfaces + nclip * (MAX_CLIP_VERTS - 2);
+	shader->reserveFaces(capacity, arena_);
+	triangles.resize(capacity);
+	triVisible.resize(capacity);
+
+	int next = nfaces;
+	for (int i = 0; i < nfaces; ++i)
+	{
+		if (!needsClip[i])
 			continue;
-		drawTriangle(screenCoords, depthShader, i, depthMap, shadowBuffer);
+		ClipVertex poly[MAX_CLIP_VERTS], clipped[MAX_CLIP_VERTS];
+		int n = 3;
+		for (int k = 0; k < 3; ++k)
+		{
+			poly[k].h = shader->clipCoord(model->vertIndex(i, k));
+			poly[k].bary = Vector3f::Unit(k);
+		}
+		// a convex polygon gains at most one vertex per plane, but rounding in
+		// the interpolated vertices can add sign changes to a nearly degenerate
+		// one; vertices past MAX_CLIP_VERTS are dropped
+		for (int plane = 0; plane < 5 && n >= 3; ++plane)
+		{
+			int m = 0;
+			for (int k = 0; k < n; ++k)
+			{
+				const ClipVertex &a = poly[k], &b = poly[(k + 1) % n];
+				float da = distance(a.h, plane), db = distance(b.h, plane);
+				if (da >= 0 && m < MAX_CLIP_VERTS)
+					clipped[m++] = a;
+				if ((da >= 0) != (db >= 0) && m < MAX_CLIP_VERTS)
+				{
+					float t = da / (da - db);
+					clipped[m].h = a.h + t * (b.h - a.h);
+					clipped[m].bary = a.bary + t * (b.bary - a.bary);
+					++m;
+				}
+			}
+			std::copy(clipped, clipped + m, poly);
+			n = m;
+		}
+		for (int k = 1; k + 1 < n; ++k)
+		{
+			const ClipVertex *fan[3] = { &poly[0], &poly[k], &poly[k + 1] };
+			Vector3f screenCoords[3];
+			for (int j = 0; j < 3; ++j)
+				screenCoords[j] = fan[j]->h.head<3>() / fan[j]->h.w();
+			if (culling(screenCoords) || !triangles[next].setup(screenCoords, 0, 1, width - 1, height))
+				continue;
+			for (int j = 0; j < 3; ++j)
+				shader->clipCorner(next, j, i, fan[j]->bary, screenCoords[j]);
+			shader->computeLOD(next, triangles[next]);
+			triVisible[next] = true;
+			++next;
+		}
 	}
+	triangles.resize(next);
+	triVisible.resize(next);
+}
 
-#pragma omp parallel for num_threads(8)
-	for (int i = 0; i < model->nfaces(); ++i)
+// append every visible triangle to the bins of the tiles its bounding box overlaps
+// binning runs serially in face order, so each tile sees its triangles in submission order;
+// frontToBack orders them by their nearest depth instead, so hierarchical z
+// sees the occluders first
+void Renderer::binTriangles(const vector<TriangleSetup> &tris, const vector<char> &visible, vector<vector<int>> &bins, bool frontToBack)
+{
+	PROFILE_SCOPE("bin");
+	int ntris = (int)tris.size();
+	for (auto &bin : bins)
+		bin.clear();
+	binOrder.clear();
+	for (int i = 0; i < ntris; ++i)
+		if (visible[i])
+			binOrder.push_back(i);
+	if (frontToBack)
 	{
-		Vector3f screenCoords[3];
-		for (int j = 0; j < 3; ++j)
+		binKey.resize(ntris);
+		for (int i : binOrder)
 		{
-			screenCoords[j] = shader->vertex(i, j);
+			const TriangleSetup &tri = tris[i];
+			binKey[i] = tri.nearestDepth(tri.minX, tri.minY, tri.maxX, tri.maxY);
 		}
-		// ޳
-		if (culling(screenCoords))
+		// ties in face order, as a stable sort would, without its buffer
+		std::sort(binOrder.begin(), binOrder.end(), [this](int a, int b) {
+			return binKey[a] > binKey[b] || (binKey[a] == binKey[b] && a < b); });
+	}
+	for (int i : binOrder)
+	{
+		const TriangleSetup &tri = tris[i];
+		int tx0 = tri.minX / TILE_SIZE, tx1 = tri.maxX / TILE_SIZE;
+		int ty0 = (height - tri.maxY) / TILE_SIZE, ty1 = (height - tri.minY) / TILE_SIZE;
+		for (int ty = ty0; ty <= ty1; ++ty)
+			for (int tx = tx0; tx <= tx1; ++tx)
+				bins[ty * tilesX + tx].push_back(i);
+	}
+}
+
+// one task per tile with triangles; tiles are independent, so no two tasks
+// ever touch the same pixel and the result does not depend on scheduling
+template <class ShaderT>
+ThreadPool::Task *Renderer::rasterizeTiles(ShaderT *shader, const vector<ThreadPool::Task *> &deps)
+{
+	tileTasks_.clear();
+	for (int t = 0; t < tilesX * tilesY; ++t)
+	{
+		if (tileBins[t].empty())
 			continue;
-		// ӿеͼԪ
-		if (!isInWindow(screenCoords[0]) &&
-			!isInWindow(screenCoords[1]) &&
-			!isInWindow(screenCoords[2]))
+		tileTasks_.push_back(pool_->submit([=] {
+			PROFILE_SCOPE("tile");
+			// clearing right before drawing leaves the tile hot in cache
+			if (tileNeedsClear[t])
+				clearTile(t);
+			tileDirty[t] = 1;
+			int minX, minY, maxX, maxY;
+			tileRect(t, minX, minY, maxX, maxY);
+			long long prepass = 0, shaded = 0;
+			if (depthPrepass_)
+			{
+				// the pre-pass leaves the hierarchical z bounds alone; the equal
+				// test already limits shading to the visible pixels
+				for (int i : tileBins[t])
+					prepass += rasterizeDepth(triangles[i], zBuffer, minX, minY, maxX, maxY);
+				for (int i : tileBins[t])
+					shaded += rasterizeTriangle(triangles[i], shader, i, frameBuffer_, zBuffer, minX, minY, maxX, maxY, spanKernelEqual_);
+				// the bounds of the blocks written above are stale
+				hiZStale.clearRect(minX / HIZ_BLOCK, (height - maxY) / HIZ_BLOCK, maxX / HIZ_BLOCK, (height - minY) / HIZ_BLOCK, 1);
+			}
+			else
+			{
+				for (int i : tileBins[t])
+				{
+					if (!occlusionCulling_)
+					{
+						shaded += rasterizeTriangle(triangles[i], shader, i, frameBuffer_, zBuffer, minX, minY, maxX, maxY, spanKernel_);
+						continue;
+					}
+					// whole triangle against the tile's bound first
+					const TriangleSetup &tri = triangles[i];
+					int x0 = max(minX, tri.minX), x1 = min(maxX, tri.maxX), y0 = max(minY, tri.minY), y1 = min(maxY, tri.maxY);
+					if (tri.nearestDepth(x0, y0, x1, y1) <= tileMinZ[t])
+						continue;
+					bool refreshed;
+					shaded += rasterizeTriangleHiZ(tri, shader, i, frameBuffer_, zBuffer, minX, minY, maxX, maxY, refreshed);
+					if (refreshed)
+						updateTileMinZ(t);
+				}
+			}
+			prepassFragments_ += prepass;
+			fragmentsShaded_ += shaded;
+			PROFILE_COUNT(FRAGMENTS_SHADED, shaded);
+		}, deps));
+	}
+	return pool_->submit([] {}, tileTasks_);
+}
+
+ThreadPool::Task *Renderer::rasterizeGBufferTiles()
+{
+	tileTasks_.clear();
+	for (int t = 0; t < tilesX * tilesY; ++t)
+	{
+		if (tileBins[t].empty())
 			continue;
-		shader->computeTBN(i);
-		drawTriangle(screenCoords, shader, i, frameBuffer_, zBuffer);
+		tileTasks_.push_back(pool_->submit([=] {
+			PROFILE_SCOPE("gbuffer tile");
+			if (tileNeedsClear[t])
+				clearTile(t);
+			tileDirty[t] = 1;
+			int minX, minY, maxX, maxY;
+			tileRect(t, minX, minY, maxX, maxY);
+			long long written = 0;
+			for (int i : tileBins[t])
+				written += rasterizeGBuffer(triangles[i], i, minX, minY, maxX, maxY);
+			hiZStale.clearRect(minX / HIZ_BLOCK, (height - maxY) / HIZ_BLOCK, maxX / HIZ_BLOCK, (height - minY) / HIZ_BLOCK, 1);
+			prepassFragments_ += written;
+		}));
 	}
+	return pool_->submit([] {}, tileTasks_);
+}
+
+// the full screen pass of deferred shading; every task shades a contiguous
+// band of rows and each pixel is shaded exactly once, whatever the overdraw
+ThreadPool::Task *Renderer::resolveGBuffer(const vector<ThreadPool::Task *> &deps)
+{
+	const int ROWS_PER_TASK = 16;
+	return pool_->parallelFor(0, (height + ROWS_PER_TASK - 1) / ROWS_PER_TASK, 1, [this, ROWS_PER_TASK](int band) {
+		PROFILE_SCOPE("resolve rows");
+		long long shaded = 0;
+		for (int row = band * ROWS_PER_TASK; row < min(height, band * ROWS_PER_TASK + ROWS_PER_TASK); ++row)
+		{
+			int *faceRow = (*gFace)[row];
+			const Vector2f *baryRow = (*gBary)[row];
+			unsigned int *colorRow = frameBuffer_[row];
+			for (int x = 0; x < width; ++x)
+			{
+				if (faceRow[x] < 0)
+					continue;
+				colorRow[x] = shader->fragment(faceRow[x], pair<float, float>(baryRow[x].x(), baryRow[x].y())).hex;
+				faceRow[x] = -1;
+				++shaded;
+			}
+		}
+		fragmentsShaded_ += shaded;
+		PROFILE_COUNT(FRAGMENTS_SHADED, shaded);
+	}, deps);
+}
+
+void Renderer::updateTileMinZ(int t)
+{
+	int minX, minY, maxX, maxY;
+	tileRect(t, minX, minY, maxX, maxY);
+	float m = hiZ[(height - maxY) / HIZ_BLOCK][minX / HIZ_BLOCK];
+	for (int br = (height - maxY) / HIZ_BLOCK; br <= (height - minY) / HIZ_BLOCK; ++br)
+		for (int bc = minX / HIZ_BLOCK; bc <= maxX / HIZ_BLOCK; ++bc)
+			m = min(m, hiZ[br][bc]);
+	tileMinZ[t] = m;
+}
+
+// every tile clears its part of the map before drawing, so the clear runs in
+// parallel and empty tiles only clear
+ThreadPool::Task *Renderer::rasterizeShadowTiles()
+{
+	tileTasks_.clear();
+	for (int t = 0; t < tilesX * tilesY; ++t)
+	{
+		tileTasks_.push_back(pool_->submit([=] {
+			PROFILE_SCOPE("shadow tile");
+			int minX, minY, maxX, maxY;
+			tileRect(t, minX, minY, maxX, maxY);
+			shadowBuffer.clearRect(minX, height - maxY, maxX, height - minY, 0);
+			for (int i : shadowBins[t])
+				rasterizeDepth16(shadowTriangles[i], shadowBuffer, height, minX, minY, maxX, maxY);
+		}));
+	}
+	return pool_->submit([] {}, tileTasks_);
+}
+
+// screen rectangle of tile t; tile rows are buffer rows, y = height - row
+void Renderer::tileRect(int t, int &minX, int &minY, int &maxX, int &maxY)
+{
+	int row0 = (t / tilesX) * TILE_SIZE, row1 = min(row0 + TILE_SIZE, height) - 1;
+	minX = (t % tilesX) * TILE_SIZE;
+	maxX = min(minX + TILE_SIZE, width) - 1;
+	minY = height - row1;
+	maxY = height - row0;
+}
+
+void Renderer::fillShadowDebugView()
+{
+	for (int i = 0; i < height; ++i)
+		for (int j = 0; j < width; ++j)
+		{
+			unsigned int g = (unsigned int)(decodeDepth16(shadowBuffer[i][j]) / DEPTH16_RANGE * 255.0f);
+			(*depthMap)[i][j] = (g << 16) | (g << 8) | g;
+		}
 }
 
 // return >0 if p left of line l0-l1
@@ -0,0 +1,243 @@
+#include "../head/ThreadPool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// slot of the calling thread; threads outside the pool use the submitting thread's slot
+static thread_local int currentSlot = 0;
+
+ThreadPool::ThreadPool(int threads, bool pinThreads) : ready_(0), unfinished_(0), stop_(false)
+{
+	if (threads <= 0)
+		threads = std::max(1, (int)thread::hardware_concurrency());
+	for (int i = 0; i < threads; ++i)
+		queues_.push_back(new Queue());
+	vector<int> cores;
+	if (pinThreads)
+		cores = allowedCores();
+	for (int i = 1; i < threads; ++i)
+		workers_.emplace_back([this, i, pinThreads, cores] {
+			currentSlot = i;
+			if (pinThreads && !cores.empty())
+				pinToCore(cores[i % cores.size()]);
+			workerLoop(i);
+		});
+}
+
+ThreadPool::~ThreadPool()
+{
+	waitAll();
+	{
+		lock_guard<mutex> lock(sleepLock_);
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for (thread &t : workers_)
+		t.join();
+	for (Queue *q : queues_)
+		delete q;
+	for (Task *t : free_)
+		delete t;
+}
+
+ThreadPool::Task *ThreadPool::newTask()
+{
+	Task *task;
+	if (free_.empty())
+		task = new Task();
+	else
+	{
+		task = free_.back();
+		free_.pop_back();
+	}
+	task->pending = 1;
+	task->done = false;
+	task->successors.clear();
+	return task;
+}
+
+void ThreadPool::schedule(Task *task, Deps deps)
+{
+	tasks_.push_back(task);
+	++unfinished_;
+	for (Task *dep : deps)
+	{
+		lock_guard<mutex> lock(dep->lock);
+		if (!dep->done)
+		{
+			dep->successors.push_back(task);
+			++task->pending;
+		}
+	}
+	if (--task->pending == 0)
+		enqueue(task);
+}
+
+void ThreadPool::Queue::push(Task *task)
+{
+	if (count == ring.size())
+	{
+		// unroll into a ring twice the size
+		vector<Task *> grown(std::max<size_t>(64, 2 * ring.size()));
+		for (size_t i = 0; i < count; ++i)
+			grown[i] = ring[(head + i) % ring.size()];
+		ring.swap(grown);
+		head = 0;
+	}
+	ring[(head + count++) % ring.size()] = task;
+}
+
+ThreadPool::Task *ThreadPool::Queue::popNewest()
+{
+	return ring[(head + --count) % ring.size()];
+}
+
+ThreadPool::Task *ThreadPool::Queue::popOldest()
+{
+	Task *task = ring[head];
+	head = (head + 1) % ring.size();
+	--count;
+	return task;
+}
+
+void ThreadPool::enqueue(Task *task)
+{
+	Queue *q = queues_[currentSlot];
+	{
+		lock_guard<mutex> lock(q->lock);
+		q->push(task);
+	}
+	++ready_;
+	lock_guard<mutex> lock(sleepLock_);
+	wake_.notify_one();
+}
+
+// the successors are released under the lock: once done is seen the task may
+// be recycled, and the list keeps its capacity for the next use
+void ThreadPool::finish(Task *task)
+{
+	{
+		lock_guard<mutex> lock(task->lock);
+		task->done = true;
+		for (Task *s : task->successors)
+			if (--s->pending == 0)
+				enqueue(s);
+	}
+	--unfinished_;
+}
+
+// own queue newest first, then the oldest task of the other queues;
+// oldestFirst takes the own queue's oldest task instead
+bool ThreadPool::runOne(int slot, bool oldestFirst)
+{
+	Task *task = nullptr;
+	int n = (int)queues_.size();
+	for (int k = 0; k < n && !task; ++k)
+	{
+		Queue *q = queues_[(slot + k) % n];
+		lock_guard<mutex> lock(q->lock);
+		if (q->count == 0)
+			continue;
+		task = k == 0 && !oldestFirst ? q->popNewest() : q->popOldest();
+	}
+	if (!task)
+		return false;
+	--ready_;
+	task->run(task->fn);
+	finish(task);
+	return true;
+}
+
+void ThreadPool::workerLoop(int slot)
+{
+	for (;;)
+	{
+		if (runOne(slot))
+			continue;
+		unique_lock<mutex> lock(sleepLock_);
+		wake_.wait(lock, [this] { return stop_ || ready_ > 0; });
+		if (stop_)
+			return;
+	}
+}
+
+void ThreadPool::wait(Task *task)
+{
+	for (;;)
+	{
+		{
+			lock_guard<mutex> lock(task->lock);
+			if (task->done)
+				return;
+		}
+		// the awaited task is older than whatever was submitted after it
+		if (!runOne(currentSlot, true))
+			this_thread::yield();
+	}
+}
+
+void ThreadPool::waitAll()
+{
+	while (unfinished_ > 0)
+		if (!runOne(currentSlot))
+			this_thread::yield();
+	for (Task *t : tasks_)
+		release(t);
+	tasks_.clear();
+}
+
+// pending tasks never point back to their dependencies, so finished ones can go
+void ThreadPool::releaseFinished(Task *keep)
+{
+	size_t n = 0;
+	for (Task *t : tasks_)
+	{
+		bool done;
+		{
+			lock_guard<mutex> lock(t->lock);
+			done = t->done;
+		}
+		if (done && t != keep)
+			release(t);
+		else
+			tasks_[n++] = t;
+	}
+	tasks_.resize(n);
+}
+
+// logical cores the calling thread may run on, in the OS's numbering
+vector<int> ThreadPool::allowedCores()
+{
+	vector<int> cores;
+#ifdef _WIN32
+	DWORD_PTR process, system;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+		for (int c = 0; c < (int)sizeof(DWORD_PTR) * 8; ++c)
+			if (process & ((DWORD_PTR)1 << c))
+				cores.push_back(c);
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+		for (int c = 0; c < CPU_SETSIZE; ++c)
+			if (CPU_ISSET(c, &set))
+				cores.push_back(c);
+#endif
+	return cores;
+}
+
+void ThreadPool::pinToCore(int core)
+{
+#ifdef _WIN32
+	SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
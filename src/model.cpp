@@ -1,60 +1,250 @@
 #include <iostream>
-#include <string>
 #include <fstream>
-#include <sstream>
+#include <string>
 #include <vector>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <Eigen/Geometry>
 #include "../head/model.h"
+#include "../head/ObjParser.h"
 
-Model::Model(const std::string& filename) : verts_(), faces_() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) 
-        {
-            iss >> trash;
-            Vector3f v;
-            for (int i=0;i<3;i++) 
-                iss >> v[i];
-            verts_.push_back(v);
-        } 
-        else if (!line.compare(0, 3, "vn "))
-        {
-            iss >> trash >> trash;
-            Vector3f n;
-            for (int i = 0; i < 3; i++)
-                iss >> n[i];
-            norms.push_back(n);
+static inline unsigned int texelByte(const unsigned char *c, int bpp, int i)
+{
+    return i < bpp ? c[i] : 0;
+}
+
+// converts a loaded TGA (bgr(a) or gray bytes, row 0 = v 0) to the texture's
+// texel format and builds its mip chain on pool; decode is called once per texel.
+// A missing map becomes one texel decoded from zero bytes, which is what
+// sampling the empty TGAImage used to return
+template <class T, class Decode, class Average>
+static void decodeTexture(ThreadPool &pool, TGAImage &img, bool loaded, Texture<T> &tex, Decode decode, Average average)
+{
+    if (!loaded || !img.buffer()) {
+        static const unsigned char zeros[4] = {};
+        tex.allocate(1, 1);
+        tex.at(0, 0) = decode(zeros, 4);
+        return;
+    }
+    int w = img.get_width(), h = img.get_height(), bpp = img.get_bytespp();
+    const unsigned char *src = img.buffer();
+    tex.allocate(w, h);
+    const int ROWS_PER_TASK = 16;
+    pool.wait(pool.parallelFor(0, h, ROWS_PER_TASK, [&](int y) {
+        for (int x = 0; x < w; ++x)
+            tex.at(x, y) = decode(src + ((size_t)y * w + x) * bpp, bpp);
+    }));
+    tex.buildMips(pool, average);
+}
+
+Model::Model(const std::string& filename, bool loadTextures, bool useMeshCache) :
+    verts_(nullptr), uv_(nullptr), norms(nullptr), faces_(nullptr), tangents_(nullptr),
+    nverts_(0), nuvs_(0), nnorms_(0), nfaces_(0), sourceModified_(-1), sourceSize_(-1) {
+    ThreadPool pool; // for the load only; .obj parsing and texture decoding run on it
+    size_t dot = filename.find_last_of(".");
+    bool isCache = dot != std::string::npos && filename.substr(dot) == ".srmesh";
+    if (isCache) {
+        if (!loadMeshCache(filename))
+            std::cerr << "can't load mesh cache " << filename << std::endl;
+    }
+    else {
+        std::string cache = meshCachePath(filename);
+        // stamped before parsing, so an edit during the load leaves the cache stale
+        bool stamped = fileStamp(filename, sourceModified_, sourceSize_);
+        if (!(useMeshCache && stamped && loadMeshCache(cache, true)) && loadObj(filename, pool) && useMeshCache) {
+            if (!writeMeshCache(cache))
+                std::cerr << "can't write mesh cache " << cache << std::endl;
         }
-        else if (!line.compare(0, 3, "vt "))
-        {
-            iss >> trash >> trash;
-            Vector2f uv;
-            for (int i = 0; i < 2; ++i)
-                iss >> uv[i];
-            uv_.push_back(uv);
+    }
+    std::cerr << "vertices: " << nverts_ << "\tfaces: "  << nfaces_ << std::endl;
+    if (!loadTextures)
+        return;
+    TGAImage img;
+    bool ok = load_texture(filename, "_diffuse.tga", img);
+    //bool ok = load_texture("obj/grid.tga", ".tga", img);
+    decodeTexture(pool, img, ok, diffusemap_, [](const unsigned char *c, int bpp) {
+        return 0xff000000u | (texelByte(c, bpp, 2) << 16) | (texelByte(c, bpp, 1) << 8) | texelByte(c, bpp, 0);
+    }, [](unsigned int a, unsigned int b, unsigned int c, unsigned int d) {
+        unsigned int r = 0;
+        for (int s = 0; s < 32; s += 8)
+            r |= ((((a >> s) & 0xff) + ((b >> s) & 0xff) + ((c >> s) & 0xff) + ((d >> s) & 0xff) + 2) >> 2) << s;
+        return r;
+    });
+    ok = load_texture(filename, "_nm_tangent.tga", img);
+    decodeTexture(pool, img, ok, normalmap_, [](const unsigned char *c, int bpp) {
+        Vector4f n(0, 0, 0, 0);
+        for (int i = 0; i < 3; ++i)
+            n[2 - i] = (float)texelByte(c, bpp, i) / 255.0 * 2.0 - 1.0;
+        return n;
+    }, [](const Vector4f &a, const Vector4f &b, const Vector4f &c, const Vector4f &d) {
+        Vector4f n = a + b + c + d;
+        float len = n.head<3>().norm();
+        return len > 0 ? Vector4f(n / len) : n;
+    });
+    // gray maps hold one byte per texel; 24 and 32 bit maps use their first,
+    // blue, byte, as sampling the TGAColor's [0] did
+    ok = load_texture(filename, "_spec.tga", img);
+    decodeTexture(pool, img, ok, specularmap_, [](const unsigned char *c, int) {
+        return c[0];
+    }, [](unsigned char a, unsigned char b, unsigned char c, unsigned char d) {
+        return (unsigned char)((a + b + c + d + 2) >> 2);
+    });
+}
+
+bool Model::loadObj(const std::string &filename, ThreadPool &pool) {
+    ObjMesh mesh;
+    if (!parseObj(filename, mesh, &pool))
+        return false;
+    ownedVerts_.swap(mesh.verts);
+    ownedUvs_.swap(mesh.uvs);
+    ownedNorms_.swap(mesh.norms);
+    ownedFaces_.swap(mesh.corners);
+    useOwnedArrays();
+    computeTangents();
+    return true;
+}
+
+// tangents are accumulated per uv index, so faces sharing a texture coordinate
+// are smoothed while uv seams and mirrored halves keep separate frames
+void Model::computeTangents() {
+    std::vector<Vector3f> tan(nuvs_, Vector3f::Zero()), bitan(nuvs_, Vector3f::Zero()), nsum(nuvs_, Vector3f::Zero());
+    for (int i = 0; i < nfaces_; ++i) {
+        const Vector3i *c = faces_ + 3 * i;
+        Vector3f e1 = verts_[c[1][0]] - verts_[c[0][0]], e2 = verts_[c[2][0]] - verts_[c[0][0]];
+        Vector2f d1 = uv_[c[1][1]] - uv_[c[0][1]], d2 = uv_[c[2][1]] - uv_[c[0][1]];
+        float r = d1.x() * d2.y() - d2.x() * d1.y();
+        if (std::abs(r) < 1e-12f)
+            continue;
+        Vector3f t = (e1 * d2.y() - e2 * d1.y()) / r;
+        Vector3f b = (e2 * d1.x() - e1 * d2.x()) / r;
+        for (int j = 0; j < 3; ++j) {
+            tan[c[j][1]] += t;
+            bitan[c[j][1]] += b;
+            nsum[c[j][1]] += norms[c[j][2]].normalized();
         }
-        else if (!line.compare(0, 2, "f ")) 
-        {
-            std::vector<Vector3i> f;
-            Vector3i tmp;
-            iss >> trash;
-            while (iss >> tmp[0] >> trash >> tmp[1] >> trash >> tmp[2]) {
-                for (int i = 0; i < 3; i++) tmp[i]--; // in wavefront obj all indices start at 1, not zero
-                f.push_back(tmp);
-            }
-            faces_.push_back(f);
+    }
+    ownedTangents_.resize(nuvs_);
+    for (int i = 0; i < nuvs_; ++i) {
+        Vector3f n = nsum[i].normalized();
+        Vector3f t = tan[i] - n * n.dot(tan[i]); // Gram-Schmidt against the normal
+        if (t.squaredNorm() < 1e-20f)
+            t = n.unitOrthogonal();
+        t.normalize();
+        float w = n.cross(t).dot(bitan[i]) < 0 ? -1.0f : 1.0f;
+        ownedTangents_[i] = Vector4f(t.x(), t.y(), t.z(), w);
+    }
+    tangents_ = ownedTangents_.data();
+}
+
+void Model::useOwnedArrays() {
+    verts_ = ownedVerts_.data();
+    uv_ = ownedUvs_.data();
+    norms = ownedNorms_.data();
+    faces_ = ownedFaces_.data();
+    nverts_ = (int)ownedVerts_.size();
+    nuvs_ = (int)ownedUvs_.size();
+    nnorms_ = (int)ownedNorms_.size();
+    nfaces_ = (int)ownedFaces_.size() / 3;
+}
+
+std::string Model::meshCachePath(const std::string &objFile) {
+    size_t dot = objFile.find_last_of(".");
+    return (dot == std::string::npos ? objFile : objFile.substr(0, dot)) + ".srmesh";
+}
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + 15) & ~(uint64_t)15;
+}
+
+bool Model::loadMeshCache(const std::string &filename, bool checkSource) {
+    if (!meshFile_.open(filename))
+        return false;
+    const MeshCacheHeader *h = (const MeshCacheHeader *)meshFile_.data();
+    uint64_t size = meshFile_.size();
+    auto fits = [size](uint64_t offset, uint64_t bytes) {
+        return offset % 16 == 0 && offset <= size && bytes <= size - offset;
+    };
+    bool ok = size >= sizeof(MeshCacheHeader) &&
+        !memcmp(h->magic, "SRMESH\0\0", 8) && h->version == MESH_CACHE_VERSION &&
+        fits(h->vertsOffset, (uint64_t)h->nverts * sizeof(Vector3f)) &&
+        fits(h->uvsOffset, (uint64_t)h->nuvs * sizeof(Vector2f)) &&
+        fits(h->normsOffset, (uint64_t)h->nnorms * sizeof(Vector3f)) &&
+        fits(h->cornersOffset, (uint64_t)h->nfaces * 3 * sizeof(Vector3i)) &&
+        fits(h->tangentsOffset, (uint64_t)h->nuvs * sizeof(Vector4f));
+    if (ok && checkSource && (h->sourceModified != sourceModified_ || h->sourceSize != sourceSize_)) {
+        meshFile_.close(); // built from another version of the .obj
+        return false;
+    }
+    const char *base = meshFile_.data();
+    // every corner is used as an index without further checks
+    if (ok) {
+        const Vector3i *corners = (const Vector3i *)(base + h->cornersOffset);
+        for (uint64_t i = 0; ok && i < (uint64_t)h->nfaces * 3; ++i) {
+            const Vector3i &c = corners[i];
+            ok = c[0] >= 0 && (uint32_t)c[0] < h->nverts &&
+                c[1] >= 0 && (uint32_t)c[1] < h->nuvs &&
+                c[2] >= 0 && (uint32_t)c[2] < h->nnorms;
         }
     }
-    std::cerr << "vertices: " << verts_.size() << "\tfaces: "  << faces_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
-    //load_texture("obj/grid.tga", ".tga", diffusemap_);
-    load_texture(filename, "_nm_tangent.tga", normalmap_);
-    load_texture(filename, "_spec.tga", specularmap_);
+    if (!ok) {
+        std::cerr << "mesh cache " << filename << " is invalid or outdated" << std::endl;
+        meshFile_.close();
+        return false;
+    }
+    verts_ = (const Vector3f *)(base + h->vertsOffset);
+    uv_ = (const Vector2f *)(base + h->uvsOffset);
+    norms = (const Vector3f *)(base + h->normsOffset);
+    faces_ = (const Vector3i *)(base + h->cornersOffset);
+    tangents_ = (const Vector4f *)(base + h->tangentsOffset);
+    nverts_ = h->nverts;
+    nuvs_ = h->nuvs;
+    nnorms_ = h->nnorms;
+    nfaces_ = h->nfaces;
+    sourceModified_ = h->sourceModified;
+    sourceSize_ = h->sourceSize;
+    return true;
+}
+
+bool Model::writeMeshCache(const std::string &filename) const {
+    MeshCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "SRMESH\0\0", 8);
+    h.version = MESH_CACHE_VERSION;
+    h.nverts = nverts_;
+    h.nuvs = nuvs_;
+    h.nnorms = nnorms_;
+    h.nfaces = nfaces_;
+    h.vertsOffset = alignOffset(sizeof(h));
+    h.uvsOffset = alignOffset(h.vertsOffset + nverts_ * sizeof(Vector3f));
+    h.normsOffset = alignOffset(h.uvsOffset + nuvs_ * sizeof(Vector2f));
+    h.cornersOffset = alignOffset(h.normsOffset + nnorms_ * sizeof(Vector3f));
+    h.tangentsOffset = alignOffset(h.cornersOffset + nfaces_ * 3 * sizeof(Vector3i));
+    h.sourceModified = sourceModified_;
+    h.sourceSize = sourceSize_;
+
+    std::string temp = tempFileName(filename);
+    std::ofstream out(temp, std::ios::binary);
+    if (!out.is_open())
+        return false;
+    auto writeAt = [&out](uint64_t offset, const void *data, size_t bytes) {
+        static const char zeros[16] = {};
+        while ((uint64_t)out.tellp() < offset)
+            out.write(zeros, std::min<uint64_t>(16, offset - (uint64_t)out.tellp()));
+        out.write((const char *)data, bytes);
+    };
+    out.write((const char *)&h, sizeof(h));
+    writeAt(h.vertsOffset, verts_, nverts_ * sizeof(Vector3f));
+    writeAt(h.uvsOffset, uv_, nuvs_ * sizeof(Vector2f));
+    writeAt(h.normsOffset, norms, nnorms_ * sizeof(Vector3f));
+    writeAt(h.cornersOffset, faces_, nfaces_ * 3 * sizeof(Vector3i));
+    writeAt(h.tangentsOffset, tangents_, nuvs_ * sizeof(Vector4f));
+    out.close();
+    if (!out.good() || !replaceFile(temp, filename)) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
 }
 
 Model::~Model() {
@@ -62,31 +252,34 @@ Model::~Model() {
 
 int Model::nverts() const
 {
-    return (int)verts_.size();
+    return nverts_;
 }
 
 int Model::nfaces() const
 {
-    return (int)faces_.size();
+    return nfaces_;
 }
 
 std::vector<int> Model::face(int idx) const 
 {
     std::vector<int> face;
-    for (int i = 0; i < (int)faces_[idx].size(); ++i)
-        face.push_back(faces_[idx][i][0]);
+    for (int i = 0; i < 3; ++i)
+        face.push_back(faces_[3 * idx + i][0]);
     return face;
 }
 
-void Model::load_texture(std::string fileName, const char *suffix, TGAImage &img)
+bool Model::load_texture(std::string fileName, const char *suffix, TGAImage &img)
 {
     std::string texfile(fileName);
     size_t dot = texfile.find_last_of(".");
+    bool ok = false;
     if (dot != std::string::npos) {
         texfile = texfile.substr(0, dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
+        ok = img.read_tga_file(texfile.c_str());
+        std::cerr << "texture file " << texfile << " loading " << (ok ? "ok" : "failed") << std::endl;
         img.flip_vertically();
     }
+    return ok;
 }
 
 Vector3f Model::vert(const int &i) const
@@ -96,48 +289,72 @@ Vector3f Model::vert(const int &i) const
 
 Vector3f Model::vert(const int &iface, const int &nthvert) const
 {
-    return verts_[faces_[iface][nthvert][0]];
+    return verts_[faces_[3 * iface + nthvert][0]];
+}
+
+int Model::vertIndex(const int &iface, const int &nthvert) const
+{
+    return faces_[3 * iface + nthvert][0];
+}
+
+const Vector3f *Model::vertData() const
+{
+    return verts_;
+}
+
+int Model::nuvs() const
+{
+    return nuvs_;
+}
+
+int Model::uvIndex(const int &iface, const int &nvert) const
+{
+    return faces_[3 * iface + nvert][1];
+}
+
+const Vector4f *Model::tangentData() const
+{
+    return tangents_;
 }
 
 Vector2i Model::uv(const int &iface, const int &nvert)
 {
-    int idx = faces_[iface][nvert][1];
-    return Vector2i(uv_[idx].x() * diffusemap_.get_width(), uv_[idx].y() * diffusemap_.get_height());
+    int idx = faces_[3 * iface + nvert][1];
+    return Vector2i(uv_[idx].x() * diffusemap_.getWidth(), uv_[idx].y() * diffusemap_.getHeight());
 }
 
 Vector3f Model::normal(const int &iface, const int &nvert)
 {
-    int idx = faces_[iface][nvert][2];
+    int idx = faces_[3 * iface + nvert][2];
     Vector3f n = norms[idx];
     n.normalize();
     return n;
 }
 
-Vector3f Model::normal(const Vector2i &uv)
+Vector3f Model::normal(const Vector2i &uv, int level)
 {
-    TGAColor c = normalmap_.get(uv[0], uv[1]);
-    Vector3f n;
-    for (int i = 0; i < 3; ++i)
-        n[2 - i] = (float)c[i] / 255.0 * 2.0 - 1.0;
-    return n;
+    return normalmap_.fetch(uv[0], uv[1], level).head<3>();
 }
 
-Color Model::diffuse(const Vector2i &uv)
+Color Model::diffuse(const Vector2i &uv, int level)
 {
-    TGAColor c = diffusemap_.get(uv.x(), uv.y());
-    return Color(c[2], c[1], c[0]);
+    unsigned int c = diffusemap_.fetch(uv.x(), uv.y(), level);
+    return Color((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
 }
 
 Color Model::diffuse(const Vector2f &uvf)
 {
-    Vector2i uv(uvf.x() * diffusemap_.get_width(), uvf.y() * diffusemap_.get_height());
-    TGAColor c = diffusemap_.get(uv.x(), uv.y());
-    return Color(c[2], c[1], c[0]);
+    return diffuse(Vector2i(uvf.x() * diffusemap_.getWidth(), uvf.y() * diffusemap_.getHeight()));
+}
+
+float Model::specular(const Vector2i &uv, int level)
+{
+    return specularmap_.fetch(uv.x(), uv.y(), level);
 }
 
-float Model::specular(const Vector2i &uv)
+int Model::mipLevels() const
 {
-    return specularmap_.get(uv.x(), uv.y())[0] / 1.0;
+    return diffusemap_.levels();
 }
 
 //Color Model::specular(Vector2i uv)
@@ -0,0 +1,247 @@
+// Golden image check: renders fixed scenes headlessly with every pipeline
+// variant and thread count and compares them to stored reference images.
+// A pixel is bad when a channel differs by more than the tolerance; a render
+// fails when more than max-bad of its pixels are bad, or when its frame arena
+// still allocates from the heap after the warm-up frames. Failing renders are
+// written next to an amplified difference image.
+// usage: goldencheck [--update] [--refs dir] [--out dir] [--tolerance n] [--max-bad fraction]
+// run from the repository root; --update renders the references with the
+// scalar kernel on one thread and writes its difference to the reference it
+// replaces, for review. golden/baseline holds the same scenes rendered before
+// the optimized paths existed; golden/README.md lists every intended change.
+// This is a standalone tool, not part of a build or test target.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <Eigen/Geometry>
+#include "../head/model.h"
+#include "../head/Renderer.h"
+#include "../head/FramePipeline.h"
+#include "../head/Camera.h"
+#include "../head/Offscreen.h"
+#include "../head/tgaimage.h"
+using namespace std;
+
+const int WIDTH = 400;
+const int HEIGHT = 400;
+// the frame arena grows during the first frame and merges its blocks into one
+// at the start of the second; after that it must not touch the heap
+const int WARMUP_FRAMES = 2;
+
+// the camera applies action steps times from its default pose
+struct Scene
+{
+	const char *name;
+	const char *model;
+	Camera::Action action;
+	int steps;
+};
+
+static const Scene scenes[] = {
+	{ "head_front", "obj/african_head/african_head.obj", Camera::Action::RIGHT, 0 },
+	{ "head_side", "obj/african_head/african_head.obj", Camera::Action::RIGHT, 15 },
+	{ "diablo_front", "obj/diablo3_pose/diablo3_pose.obj", Camera::Action::RIGHT, 0 },
+	{ "diablo_near", "obj/diablo3_pose/diablo3_pose.obj", Camera::Action::ZOOM_IN, 22 }, // clips against the near plane
+};
+
+struct Variant
+{
+	string name;
+	RasterISA isa;
+	bool occlusionCulling;
+	bool depthPrepass;
+	bool deferredShading;
+	bool pipelined; // through a FramePipeline
+};
+
+static vector<Variant> pipelineVariants()
+{
+	vector<Variant> variants;
+	const pair<RasterISA, const char *> isas[] = {
+		{ RasterISA::SCALAR, "scalar" }, { RasterISA::SSE2, "sse2" }, { RasterISA::AVX2, "avx2" } };
+	for (const auto &isa : isas)
+		if (isRasterISASupported(isa.first))
+			variants.push_back({ isa.second, isa.first, false, false, false, false });
+	RasterISA best = bestRasterISA();
+	variants.push_back({ "hiz", best, true, false, false, false });
+	variants.push_back({ "prepass", best, false, true, false, false });
+	variants.push_back({ "deferred", best, true, false, true, false });
+	variants.push_back({ "pipelined", best, true, false, false, true });
+	return variants;
+}
+
+// The scene is drawn for the warm-up frames and once more, and the last frame
+// is kept, so the lazy tile clears and the cached shadow map are part of what
+// is checked. Returns false if a frame arena allocated in that last frame.
+static bool render(Model &model, const Scene &scene, const Variant &variant, int threads, TGAImage &img)
+{
+	OffscreenBuffer target(WIDTH, HEIGHT);
+	Camera camera;
+	for (int i = 0; i < scene.steps; ++i)
+		camera.move(scene.action);
+	auto configure = [&](Renderer &renderer) {
+		renderer.setRasterISA(variant.isa);
+		renderer.setOcclusionCulling(variant.occlusionCulling);
+		renderer.setDepthPrepass(variant.depthPrepass);
+		renderer.setDeferredShading(variant.deferredShading);
+	};
+	if (variant.pipelined)
+	{
+		// frames alternate between the renderers, so each of them draws its
+		// warm-up frames and then one more
+		const int FRAMES = FramePipeline::FRAMES_IN_FLIGHT;
+		FramePipeline pipeline(WIDTH, HEIGHT, target.data(), &camera, Vector3f(1, 1, 1));
+		pipeline.setThreadCount(threads);
+		for (int i = 0; i < FRAMES; ++i)
+			configure(pipeline.getRenderer(i));
+		size_t warm[FRAMES] = {};
+		for (int frame = 0; frame < (WARMUP_FRAMES + 1) * FRAMES; ++frame)
+		{
+			if (frame == WARMUP_FRAMES * FRAMES)
+			{
+				pipeline.flush();
+				for (int i = 0; i < FRAMES; ++i)
+					warm[i] = pipeline.getRenderer(i).getArena().heapAllocations();
+			}
+			pipeline.drawFrame(&model);
+		}
+		pipeline.flush();
+		target.toImage(img);
+		bool steady = true;
+		for (int i = 0; i < FRAMES; ++i)
+			steady = steady && pipeline.getRenderer(i).getArena().heapAllocations() == warm[i];
+		return steady;
+	}
+	Renderer renderer(WIDTH, HEIGHT, target.data(), &camera, Vector3f(1, 1, 1));
+	renderer.setThreadCount(threads);
+	configure(renderer);
+	size_t warm = 0;
+	for (int frame = 0; frame <= WARMUP_FRAMES; ++frame)
+	{
+		if (frame == WARMUP_FRAMES)
+			warm = renderer.getArena().heapAllocations();
+		renderer.bufferClear();
+		renderer.drawModel(&model, Renderer::DrawMode::TRIANGLE);
+	}
+	target.toImage(img);
+	return renderer.getArena().heapAllocations() == warm;
+}
+
+// returns the number of bad pixels, or -1 if the sizes differ
+static long long compare(TGAImage &a, TGAImage &b, int tolerance, int &maxDiff, TGAImage &diff)
+{
+	if (a.get_width() != b.get_width() || a.get_height() != b.get_height())
+		return -1;
+	long long bad = 0;
+	maxDiff = 0;
+	diff = TGAImage(a.get_width(), a.get_height(), TGAImage::RGB);
+	for (int y = 0; y < a.get_height(); ++y)
+		for (int x = 0; x < a.get_width(); ++x)
+		{
+			TGAColor ca = a.get(x, y), cb = b.get(x, y), cd;
+			int worst = 0;
+			for (int c = 0; c < 3; ++c)
+			{
+				int d = abs((int)ca.bgra[c] - (int)cb.bgra[c]);
+				worst = max(worst, d);
+				cd.bgra[c] = (unsigned char)min(255, d * 8);
+			}
+			diff.set(x, y, cd);
+			maxDiff = max(maxDiff, worst);
+			bad += worst > tolerance;
+		}
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	bool update = false;
+	string refDir = "golden", outDir = ".";
+	int tolerance = 2;
+	double maxBad = 0.0005;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--update")
+			update = true;
+		else if (arg == "--refs" && i + 1 < argc)
+			refDir = argv[++i];
+		else if (arg == "--out" && i + 1 < argc)
+			outDir = argv[++i];
+		else if (arg == "--tolerance" && i + 1 < argc)
+			tolerance = atoi(argv[++i]);
+		else if (arg == "--max-bad" && i + 1 < argc)
+			maxBad = atof(argv[++i]);
+		else
+		{
+			cerr << "usage: goldencheck [--update] [--refs dir] [--out dir] [--tolerance n] [--max-bad fraction]" << endl;
+			return 2;
+		}
+	}
+
+	vector<Variant> variants = pipelineVariants();
+	// more threads than cores still reorders the tasks, so always try several
+	vector<int> threadCounts = { 1, max(4, (int)thread::hardware_concurrency()) };
+
+	int failures = 0, checks = 0;
+	for (const Scene &scene : scenes)
+	{
+		Model model(scene.model);
+		string refFile = refDir + "/" + scene.name + ".tga";
+		if (update)
+		{
+			TGAImage img, old, diff;
+			render(model, scene, variants[0], 1, img);
+			int maxDiff;
+			long long bad = old.read_tga_file(refFile.c_str()) ? compare(img, old, tolerance, maxDiff, diff) : -1;
+			if (bad >= 0 && maxDiff > 0)
+			{
+				string diffFile = outDir + "/" + scene.name + ".update.diff.tga";
+				diff.write_tga_file(diffFile.c_str());
+				cout << scene.name << ": max difference " << maxDiff << ", " << bad << " pixels above tolerance, see " << diffFile << endl;
+			}
+			bool ok = img.write_tga_file(refFile.c_str());
+			cout << (ok ? "wrote " : "can not write ") << refFile << endl;
+			failures += !ok;
+			continue;
+		}
+
+		TGAImage ref;
+		if (!ref.read_tga_file(refFile.c_str()))
+		{
+			cout << "FAIL " << scene.name << ": no reference " << refFile << endl;
+			++failures;
+			continue;
+		}
+		for (const Variant &variant : variants)
+			for (int threads : threadCounts)
+			{
+				string name = string(scene.name) + "_" + variant.name + "_t" + to_string(threads);
+				TGAImage img, diff;
+				bool steady = render(model, scene, variant, threads, img);
+				int maxDiff;
+				long long bad = compare(img, ref, tolerance, maxDiff, diff);
+				bool pass = steady && bad >= 0 && bad <= maxBad * WIDTH * HEIGHT;
+				++checks;
+				cout << (pass ? "PASS " : "FAIL ") << name;
+				if (bad < 0)
+					cout << ": size differs from the reference";
+				else
+					cout << ": max difference " << maxDiff << ", " << bad << " pixels above tolerance";
+				cout << (steady ? "" : ", frame arena allocated after warm-up") << endl;
+				if (!pass)
+				{
+					++failures;
+					img.write_tga_file((outDir + "/" + name + ".tga").c_str());
+					diff.write_tga_file((outDir + "/" + name + ".diff.tga").c_str());
+				}
+			}
+	}
+	if (!update)
+		cout << checks - failures << " of " << checks << " renders match" << endl;
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,30 @@
+// Converts a Wavefront .obj into the binary mesh cache format read by Model.
+// usage: obj2srmesh input.obj [output.srmesh]
+#include <iostream>
+#include <string>
+#include "../head/model.h"
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " input.obj [output.srmesh]" << std::endl;
+		return 1;
+	}
+	std::string input = argv[1];
+	std::string output = argc > 2 ? argv[2] : Model::meshCachePath(input);
+
+	Model model(input, false, false); // always parse the .obj, skip textures
+	if (model.nfaces() == 0)
+	{
+		std::cerr << "no faces read from " << input << std::endl;
+		return 1;
+	}
+	if (!model.writeMeshCache(output))
+	{
+		std::cerr << "can't write " << output << std::endl;
+		return 1;
+	}
+	std::cerr << "wrote " << output << std::endl;
+	return 0;
+}
@@ -0,0 +1,61 @@
+// Times the chunked parallel .obj parser against the original stream parser
+// and checks that both produce the same mesh.
+// usage: objbench [model.obj] [repeats]
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../head/ObjParser.h"
+#include "../head/ThreadPool.h"
+using namespace std;
+using namespace std::chrono;
+
+template <class F>
+static double bestOf(int repeats, F f)
+{
+	double best = 1e30;
+	for (int i = 0; i < repeats; ++i)
+	{
+		auto start = steady_clock::now();
+		f();
+		best = min(best, duration<double>(steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+template <class V>
+static float maxDiff(const vector<V> &a, const vector<V> &b)
+{
+	float d = 0;
+	for (size_t i = 0; i < a.size() && i < b.size(); ++i)
+		d = max(d, (a[i] - b[i]).cwiseAbs().maxCoeff());
+	return d;
+}
+
+int main(int argc, char **argv)
+{
+	string path = argc > 1 ? argv[1] : "obj/diablo3_pose/diablo3_pose.obj";
+	int repeats = argc > 2 ? max(1, atoi(argv[2])) : 10;
+
+	ObjMesh reference, mesh;
+	ThreadPool pool;
+	double stream = bestOf(repeats, [&] { parseObjStream(path, reference); });
+	double chunked = bestOf(repeats, [&] { parseObj(path, mesh, &pool); });
+
+	bool same = reference.verts.size() == mesh.verts.size() &&
+		reference.uvs.size() == mesh.uvs.size() &&
+		reference.norms.size() == mesh.norms.size() &&
+		reference.corners == mesh.corners;
+	float diff = max(max(maxDiff(reference.verts, mesh.verts), maxDiff(reference.uvs, mesh.uvs)),
+		maxDiff(reference.norms, mesh.norms));
+
+	cout << path << ": " << mesh.verts.size() << " v, " << mesh.uvs.size() << " vt, "
+		<< mesh.norms.size() << " vn, " << mesh.corners.size() / 3 << " triangles" << endl;
+	cout << "stream parser:  " << stream * 1000 << " ms" << endl;
+	cout << "chunked parser: " << chunked * 1000 << " ms (" << stream / chunked << "x)" << endl;
+	cout << "meshes " << (same ? "match" : "DIFFER") << ", max value difference " << diff << endl;
+	return same ? 0 : 1;
+}
@@ -0,0 +1,329 @@
+// Rendering benchmark: replays fixed camera paths over the sample models at
+// several resolutions and task pool sizes, with and without frame pipelining, plus micro-benchmarks of the raster
+// helpers, the texture reads and the .obj loader. Results go to a JSON file.
+// usage: renderbench [output.json] [frames per path]
+// run from the repository root so the sample models are found
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <Eigen/Geometry>
+#include "../head/model.h"
+#include "../head/Renderer.h"
+#include "../head/FramePipeline.h"
+#include "../head/Camera.h"
+#include "../head/Offscreen.h"
+#include "../head/tgaimage.h"
+using namespace std;
+using namespace std::chrono;
+
+// a camera path: every frame applies action steps times before drawing
+struct CameraPath
+{
+	const char *name;
+	Camera::Action action;
+	int steps;
+};
+
+// Camera starts at distance 3 from the origin; the models are about 1 unit in
+// radius. Zooming in stops at distance 0.3, well inside the mesh, so most of
+// the frames clip against the near plane. Zooming out ends at distance 3 + 0.3 * frames.
+static const CameraPath paths[] = {
+	{ "orbit", Camera::Action::RIGHT, 1 },
+	{ "zoom_in", Camera::Action::ZOOM_IN, 1 },
+	{ "zoom_out", Camera::Action::ZOOM_OUT, 3 },
+};
+
+struct FrameResult
+{
+	string model;
+	string path;
+	int width, height, threads, frames;
+	bool pipelined;
+	double medianMs, p99Ms;
+	double trianglesPerSec, fragmentsPerSec;
+};
+
+static double percentile(vector<double> v, double p)
+{
+	sort(v.begin(), v.end());
+	size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+	return v[min(i, v.size() - 1)];
+}
+
+template <class F>
+static double bestOf(int repeats, F f)
+{
+	double best = 1e30;
+	for (int i = 0; i < repeats; ++i)
+	{
+		auto start = steady_clock::now();
+		f();
+		best = min(best, duration<double>(steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+// pipelined frames are timed from one drawFrame() to the next, which is the
+// throughput; the first frame's result reaches the target one frame later
+static FrameResult runPath(Model &model, const string &modelName, const CameraPath &path, int w, int h, int threads, int frames,
+	bool pipelined)
+{
+	OffscreenBuffer target(w, h);
+	Camera camera;
+	Renderer *renderer = nullptr;
+	FramePipeline *pipeline = nullptr;
+	if (pipelined)
+	{
+		pipeline = new FramePipeline(w, h, target.data(), &camera, Vector3f(1, 1, 1));
+		pipeline->setThreadCount(threads);
+	}
+	else
+	{
+		renderer = new Renderer(w, h, target.data(), &camera, Vector3f(1, 1, 1));
+		renderer->setThreadCount(threads);
+	}
+	// zooming in stops short of the camera target
+	int maxZoomSteps = 27;
+	auto draw = [&] {
+		if (pipeline)
+			pipeline->drawFrame(&model);
+		else
+		{
+			renderer->bufferClear();
+			renderer->drawModel(&model, Renderer::DrawMode::TRIANGLE);
+		}
+	};
+
+	// untimed frames render the shadow maps and grow the frame arenas
+	for (int i = 0; i < (pipeline ? FramePipeline::FRAMES_IN_FLIGHT : 1); ++i)
+		draw();
+
+	vector<double> times;
+	long long fragments = 0;
+	double total = 0;
+	int zoomSteps = 0;
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		for (int s = 0; s < path.steps; ++s)
+			if (path.action != Camera::Action::ZOOM_IN || zoomSteps++ < maxZoomSteps)
+				camera.move(path.action);
+		auto start = steady_clock::now();
+		draw();
+		double t = duration<double>(steady_clock::now() - start).count();
+		times.push_back(t * 1000);
+		total += t;
+		fragments += pipeline ? pipeline->getFrameStats().fragmentsShaded : renderer->getFrameStats().fragmentsShaded;
+	}
+	delete pipeline;
+	delete renderer;
+
+	FrameResult r;
+	r.model = modelName;
+	r.path = path.name;
+	r.width = w;
+	r.height = h;
+	r.threads = threads;
+	r.frames = frames;
+	r.pipelined = pipelined;
+	r.medianMs = percentile(times, 0.5);
+	r.p99Ms = percentile(times, 0.99);
+	r.trianglesPerSec = (double)model.nfaces() * frames / total;
+	r.fragmentsPerSec = fragments / total;
+	return r;
+}
+
+// flat color, so drawTriangle is timed without the Phong shader
+class FlatShader : public FShader
+{
+public:
+	virtual Vector3f vertex(int, int) { return Vector3f(); }
+	virtual Color fragment(int, std::pair<float, float>) { return Color(255, 255, 255); }
+};
+
+static volatile float sink; // keeps the timed loops' results alive
+
+struct MicroResult
+{
+	string name;
+	double nsPerOp;
+};
+
+static bool copyFile(const string &from, const string &to)
+{
+	ifstream in(from, ios::binary);
+	ofstream out(to, ios::binary);
+	if (!in || !out)
+		return false;
+	out << in.rdbuf();
+	return (bool)out;
+}
+
+// scratch is a path prefix for temporary copies of the models
+static vector<MicroResult> runMicro(const vector<string> &modelPaths, const string &scratch)
+{
+	vector<MicroResult> results;
+	const int W = 800, H = 800;
+	mt19937 rng(1);
+	uniform_real_distribution<float> pos(0, (float)W), depth(0, 1);
+
+	OffscreenBuffer target(W, H);
+	Camera camera;
+	Renderer renderer(W, H, target.data(), &camera, Vector3f(1, 1, 1));
+
+	// barycentric: points in and around one triangle
+	{
+		const int N = 1 << 20;
+		Vector3f v0(100, 100, 0), v1(700, 200, 0), v2(300, 700, 0);
+		vector<Vector2i> points(N);
+		for (Vector2i &p : points)
+			p = Vector2i((int)pos(rng), (int)pos(rng));
+		double t = bestOf(5, [&] {
+			float sum = 0;
+			for (const Vector2i &p : points)
+				sum += renderer.barycentric(v0, v1, v2, p).first;
+			sink = sum;
+		});
+		results.push_back({ "barycentric", t * 1e9 / N });
+	}
+
+	// drawTriangle: random 50 pixel triangles through the span kernels
+	{
+		const int N = 1 << 14;
+		vector<Vector3f> tris(3 * N);
+		uniform_real_distribution<float> offset(-25, 25);
+		for (int i = 0; i < N; ++i)
+		{
+			Vector3f c(pos(rng), pos(rng), 0);
+			c = c.cwiseMax(Vector3f(30, 30, 0)).cwiseMin(Vector3f(W - 30, H - 30, 0));
+			for (int j = 0; j < 3; ++j)
+				tris[3 * i + j] = c + Vector3f(offset(rng), offset(rng), depth(rng));
+		}
+		FlatShader flat;
+		double t = bestOf(5, [&] {
+			renderer.bufferClear();
+			for (int i = 0; i < N; ++i)
+				renderer.drawTriangle(&tris[3 * i], &flat, i, renderer.getFrameBuffer(), renderer.getZBuffer());
+		});
+		results.push_back({ "drawTriangle", t * 1e9 / N });
+	}
+
+	// TGAImage::get: random reads from a diffuse map
+	{
+		TGAImage img;
+		if (img.read_tga_file("obj/african_head/african_head_diffuse.tga"))
+		{
+			const int N = 1 << 20;
+			vector<Vector2i> points(N);
+			uniform_int_distribution<int> x(0, img.get_width() - 1), y(0, img.get_height() - 1);
+			for (Vector2i &p : points)
+				p = Vector2i(x(rng), y(rng));
+			double t = bestOf(5, [&] {
+				unsigned int sum = 0;
+				for (const Vector2i &p : points)
+					sum += img.get(p.x(), p.y()).bgra[0];
+				sink = (float)sum;
+			});
+			results.push_back({ "TGAImage::get", t * 1e9 / N });
+		}
+	}
+
+	// .obj load: parsing the text, and mapping the binary mesh cache. Both run
+	// on a copy, so the cache is written and removed next to it instead of
+	// next to the sample model
+	for (const string &path : modelPaths)
+	{
+		string name = path.substr(path.find_last_of('/') + 1);
+		string copy = scratch + name;
+		if (!copyFile(path, copy))
+		{
+			cerr << "can not copy " << path << " to " << copy << endl;
+			continue;
+		}
+		double parse = bestOf(3, [&] { Model m(copy, false, false); });
+		{ Model warm(copy, false, true); } // writes the cache
+		double cached = bestOf(3, [&] { Model m(copy, false, true); });
+		remove(copy.c_str());
+		remove(Model::meshCachePath(copy).c_str());
+		results.push_back({ "obj load " + name, parse * 1e9 });
+		results.push_back({ "mesh cache load " + name, cached * 1e9 });
+	}
+	return results;
+}
+
+static bool writeJSON(const string &file, const vector<FrameResult> &frames, const vector<MicroResult> &micro)
+{
+	ofstream out(file);
+	if (!out)
+		return false;
+	out << "{\n\t\"frames\": [";
+	for (size_t i = 0; i < frames.size(); ++i)
+	{
+		const FrameResult &r = frames[i];
+		out << (i ? "," : "") << "\n\t\t{\"model\": \"" << r.model << "\", \"path\": \"" << r.path
+			<< "\", \"width\": " << r.width << ", \"height\": " << r.height << ", \"threads\": " << r.threads
+			<< ", \"pipelined\": " << (r.pipelined ? "true" : "false")
+			<< ", \"frames\": " << r.frames << ", \"median_ms\": " << r.medianMs << ", \"p99_ms\": " << r.p99Ms
+			<< ", \"triangles_per_sec\": " << r.trianglesPerSec << ", \"fragments_per_sec\": " << r.fragmentsPerSec << "}";
+	}
+	out << "\n\t],\n\t\"micro\": [";
+	for (size_t i = 0; i < micro.size(); ++i)
+		out << (i ? "," : "") << "\n\t\t{\"name\": \"" << micro[i].name << "\", \"ns_per_op\": " << micro[i].nsPerOp << "}";
+	out << "\n\t]\n}\n";
+	return (bool)out;
+}
+
+int main(int argc, char **argv)
+{
+	string output = argc > 1 ? argv[1] : "bench.json";
+	int frames = argc > 2 ? max(1, atoi(argv[2])) : 60;
+
+	const vector<string> modelPaths = {
+		"obj/african_head/african_head.obj",
+		"obj/diablo3_pose/diablo3_pose.obj"
+	};
+	const int resolutions[][2] = { { 400, 400 }, { 800, 800 }, { 1600, 1200 } };
+	int cores = max(1, (int)thread::hardware_concurrency());
+	vector<int> threadCounts;
+	for (int t = 1; t < cores; t *= 2)
+		threadCounts.push_back(t);
+	threadCounts.push_back(cores);
+
+	vector<FrameResult> frameResults;
+	for (const string &path : modelPaths)
+	{
+		Model model(path, true, false); // no mesh cache, the benchmark leaves obj/ unchanged
+		string name = path.substr(path.find_last_of('/') + 1);
+		name = name.substr(0, name.find('.'));
+		for (const CameraPath &cameraPath : paths)
+			for (const auto &res : resolutions)
+				for (int threads : threadCounts)
+					for (int pipelined = 0; pipelined < 2; ++pipelined)
+					{
+						FrameResult r = runPath(model, name, cameraPath, res[0], res[1], threads, frames, pipelined != 0);
+						cout << r.model << " " << r.path << " " << r.width << "x" << r.height << " " << r.threads << " threads"
+							<< (r.pipelined ? " pipelined" : "") << ": median "
+							<< r.medianMs << " ms, p99 " << r.p99Ms << " ms, " << r.trianglesPerSec / 1e6 << " Mtri/s, "
+							<< r.fragmentsPerSec / 1e6 << " Mfrag/s" << endl;
+						frameResults.push_back(r);
+					}
+	}
+
+	vector<MicroResult> micro = runMicro(modelPaths, output + ".tmp.");
+	for (const MicroResult &m : micro)
+		cout << m.name << ": " << m.nsPerOp << " ns" << endl;
+
+	if (!writeJSON(output, frameResults, micro))
+	{
+		cerr << "can not write " << output << endl;
+		return 1;
+	}
+	cout << "results written to " << output << endl;
+	return 0;
+}